@@ -0,0 +1,325 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Eva worker pool: runs many scripts in parallel on a pool
+ * of VM isolates (one per core).
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/Logger.h"
+#include "src/vm/EvaVM.h"
+#include "src/vm/EvaValue.h"
+
+/**
+ * Upper bound of the -w option.
+ */
+#define MAX_WORKERS 1024
+
+void printHelp() {
+  std::cout << "\nUsage: eva-pool [options] [expression...]\n\n"
+            << "Options:\n"
+            << "    -j, --jobs        Jobs file: an expression per line, e.g. a call of\n"
+            << "                      a prelude function (square 4), or @<file> for a script\n"
+            << "    -p, --prelude     Script run once per worker (its globals are visible to jobs)\n"
+            << "    -w, --workers     Number of VM isolates, 1 to 1024 (default: number of cores)\n"
+            << "    --snapshot        Heap snapshot (.evas) each worker starts from\n\n";
+}
+
+/**
+ * Job: a program to execute, and its outcome.
+ */
+struct Job {
+  // Job source: expression or script file name
+  std::string source;
+  bool isFile = false;
+  // Result (printed), worker index and latency
+  std::string result;
+  size_t worker = 0;
+  std::chrono::nanoseconds latency{0};
+  // The script can't be read, or a runtime error (no latency)
+  bool failed = false;
+};
+
+/**
+ * Work-stealing queue of job indices: the owner takes from the
+ * front, thieves take from the back.
+ */
+struct JobQueue {
+  std::mutex mutex;
+  std::deque<size_t> jobs;
+
+  bool pop(size_t& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (jobs.empty()) {
+      return false;
+    }
+    job = jobs.front();
+    jobs.pop_front();
+    return true;
+  }
+
+  bool steal(size_t& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (jobs.empty()) {
+      return false;
+    }
+    job = jobs.back();
+    jobs.pop_back();
+    return true;
+  }
+};
+
+/**
+ * Reads a script file.
+ */
+bool readFile(const std::string& fileName, std::string& text) {
+  SourceFile file;
+  if (!file.open(fileName)) {
+    return false;
+  }
+  text = file.text;
+  return true;
+}
+
+/**
+ * Parses a count option in [1, max], e.g. the number of workers.
+ */
+bool parseCount(const char* text, long max, size_t& count) {
+  char* end;
+  errno = 0;
+  auto value = std::strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0 || value < 1 || value > max) {
+    return false;
+  }
+  count = value;
+  return true;
+}
+
+/**
+ * Latency percentile (sorted latencies).
+ */
+double percentileMs(const std::vector<std::chrono::nanoseconds>& sorted,
+                    double percentile) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto index = (size_t)(percentile * (sorted.size() - 1));
+  return sorted[index].count() / 1e6;
+}
+
+/**
+ * Eva worker pool main executable.
+ */
+int main(int argc, char const *argv[]) {
+  /**
+   * Jobs to run.
+   */
+  std::vector<Job> jobs;
+
+  /**
+   * Prelude script, and heap snapshot to start from.
+   */
+  std::string prelude;
+  std::string snapshotFile;
+
+  /**
+   * Number of workers.
+   */
+  size_t workersCount = std::max(1u, std::thread::hardware_concurrency());
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    auto hasValue = i + 1 < argc;
+    if ((option == "-j" || option == "--jobs") && hasValue) {
+      std::ifstream jobsFile(argv[++i]);
+      if (!jobsFile) {
+        std::cerr << "Can't read jobs file " << argv[i] << "\n";
+        return 1;
+      }
+      std::string line;
+      while (std::getline(jobsFile, line)) {
+        if (line.empty()) {
+          continue;
+        }
+        if (line[0] == '@') {
+          jobs.push_back({line.substr(1), true});
+        } else {
+          jobs.push_back({line});
+        }
+      }
+    } else if ((option == "-p" || option == "--prelude") && hasValue) {
+      if (!readFile(argv[++i], prelude)) {
+        std::cerr << "Can't read file " << argv[i] << "\n";
+        return 1;
+      }
+    } else if ((option == "-w" || option == "--workers") && hasValue) {
+      if (!parseCount(argv[++i], MAX_WORKERS, workersCount)) {
+        std::cerr << "Invalid number of workers " << argv[i] << "\n";
+        return 1;
+      }
+    } else if (option == "--snapshot" && hasValue) {
+      snapshotFile = argv[++i];
+    } else if (option[0] == '-') {
+      printHelp();
+      return 0;
+    } else {
+      jobs.push_back({option});
+    }
+  }
+
+  if (jobs.empty()) {
+    printHelp();
+    return 0;
+  }
+
+  /**
+   * Initial distribution: round-robin, idle workers steal the rest.
+   */
+  std::vector<JobQueue> queues(workersCount);
+  for (size_t i = 0; i < jobs.size(); i++) {
+    queues[i % workersCount].jobs.push_back(i);
+  }
+
+  /**
+   * Workers are ready (warmed up) before the clock starts.
+   */
+  std::atomic<size_t> ready{0};
+  std::atomic<bool> failed{false};
+  std::atomic<bool> go{false};
+  std::mutex errorMutex;
+  std::chrono::steady_clock::time_point start;
+
+  auto worker = [&](size_t index) {
+    // Errors of a job are reported with the job, the other jobs
+    // (and the other isolates) keep running
+    ErrorHandler errorHandler;
+    // Isolate of this worker
+    EvaVM vm;
+    if (!snapshotFile.empty() && !vm.restoreSnapshot(snapshotFile)) {
+      std::cerr << "Invalid snapshot " << snapshotFile << "\n";
+      failed = true;
+    }
+    if (!failed && !prelude.empty()) {
+      try {
+        vm.exec(prelude);
+      } catch (const EvaError& error) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        std::cerr << "Prelude error: " << error.what() << "\n";
+        failed = true;
+      }
+    }
+    ready++;
+    while (!go) {
+      std::this_thread::yield();
+    }
+    if (failed) {
+      return;
+    }
+
+    size_t jobIndex;
+    for (;;) {
+      // Own queue first, then steal from the others
+      auto found = queues[index].pop(jobIndex);
+      for (size_t i = 1; !found && i < workersCount; i++) {
+        found = queues[(index + i) % workersCount].steal(jobIndex);
+      }
+      if (!found) {
+        return;
+      }
+      auto& job = jobs[jobIndex];
+      std::string program = job.source;
+      if (job.isFile && !readFile(job.source, program)) {
+        job.result = "error: can't read file " + job.source;
+        job.worker = index;
+        job.failed = true;
+        continue;
+      }
+      job.worker = index;
+      try {
+        auto jobStart = std::chrono::steady_clock::now();
+        auto result = vm.exec(program);
+        job.latency = std::chrono::steady_clock::now() - jobStart;
+        job.result = evaValueToConstantString(result);
+      } catch (const EvaError& error) {
+        job.result = "error: " + std::string(error.what());
+        job.result.erase(job.result.find_last_not_of('\n') + 1);
+        job.failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < workersCount; i++) {
+    threads.emplace_back(worker, i);
+  }
+  while (ready < workersCount) {
+    std::this_thread::yield();
+  }
+  start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  if (failed) {
+    return 1;
+  }
+
+  /**
+   * Results and per-job latency (of the jobs which ran).
+   */
+  std::vector<std::chrono::nanoseconds> latencies;
+  size_t failedCount = 0;
+  std::cout << "\n---------- Results ----------\n\n";
+  for (size_t i = 0; i < jobs.size(); i++) {
+    auto& job = jobs[i];
+    std::cout << "#" << i << " [worker " << job.worker << ", ";
+    if (job.failed) {
+      failedCount++;
+      std::cout << "failed";
+    } else {
+      latencies.push_back(job.latency);
+      std::cout << job.latency.count() / 1e6 << " ms";
+    }
+    std::cout << "] " << job.source << " = " << job.result << "\n";
+  }
+
+  /**
+   * Aggregate throughput (of the completed jobs).
+   */
+  std::sort(latencies.begin(), latencies.end());
+  auto seconds = std::chrono::duration<double>(elapsed).count();
+  std::cout << "\n---------- Summary ----------\n\n"
+            << "Workers    : " << workersCount << "\n"
+            << "Jobs       : " << latencies.size() << " completed, "
+            << failedCount << " failed\n"
+            << "Wall time  : " << seconds * 1e3 << " ms\n"
+            << "Throughput : " << (seconds > 0 ? latencies.size() / seconds : 0)
+            << " jobs/s\n"
+            << "Latency    : p50 " << percentileMs(latencies, 0.5) << " ms, p99 "
+            << percentileMs(latencies, 0.99) << " ms, max "
+            << percentileMs(latencies, 1.0) << " ms\n";
+
+  return 0;
+}
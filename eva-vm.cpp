@@ -12,6 +12,8 @@
  * Eva VM executable.
  */
 
+#include <fcntl.h>
+
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -24,46 +26,120 @@ void printHelp() {
   std::cout << "\nUsage: eva-vm [options]\n\n"
             << "Options:\n"
             << "    -e, --expression  Expression to parse\n"
-            << "    -f, --file        File to parse\n\n";
+            << "    -f, --file        File to parse\n"
+            << "    -c, --cache       Bytecode cache file (.evac), written if stale\n"
+            << "    --snapshot        Heap snapshot (.evas) to start from\n"
+            << "    --make-snapshot   File to save the heap snapshot to at exit\n"
+            << "    --gc-stats        File to dump GC stats (JSON) at exit\n"
+            << "    --profile         File to write sampled stacks (folded, for flamegraph.pl)\n"
+            << "    --trace           Trace categories: disasm,gc,calls or all (default: quiet)\n"
+            << "    --trace-level     Trace level: info or verbose (default: info)\n"
+            << "    --trace-file      File to write the trace to (default: stderr)\n\n";
 }
 
 /**
  * Eva VM main executable.
  */
 int main(int argc, char const *argv[]) {
-  if (argc != 3) {
-    printHelp();
-    return 0;
-  }
-
   /**
    * Expression mode.
    */
-  std::string mode = argv[1];
+  std::string mode;
+
+  /**
+   * Expression or file name.
+   */
+  std::string input;
+
+  /**
+   * Bytecode cache file.
+   */
+  std::string cacheFile;
+
+  /**
+   * Heap snapshot files to restore from, and to save.
+   */
+  std::string snapshotFile;
+  std::string makeSnapshotFile;
+
+  /**
+   * GC stats output file.
+   */
+  std::string gcStatsFile;
+
+  /**
+   * Sampling profiler output file.
+   */
+  std::string profileFile;
+
+  /**
+   * Trace categories, level and output file.
+   */
+  std::string traceCategories;
+  std::string traceLevel = "info";
+  std::string traceFile;
+
+  for (int i = 1; i < argc; i += 2) {
+    std::string option = argv[i];
+    if (i + 1 == argc) {
+      printHelp();
+      return 0;
+    }
+    if (option == "-e" || option == "--expression") {
+      mode = "-e";
+      input = argv[i + 1];
+    } else if (option == "-f" || option == "--file") {
+      mode = "-f";
+      input = argv[i + 1];
+    } else if (option == "-c" || option == "--cache") {
+      cacheFile = argv[i + 1];
+    } else if (option == "--snapshot") {
+      snapshotFile = argv[i + 1];
+    } else if (option == "--make-snapshot") {
+      makeSnapshotFile = argv[i + 1];
+    } else if (option == "--gc-stats") {
+      gcStatsFile = argv[i + 1];
+    } else if (option == "--profile") {
+      profileFile = argv[i + 1];
+    } else if (option == "--trace") {
+      traceCategories = argv[i + 1];
+    } else if (option == "--trace-level") {
+      traceLevel = argv[i + 1];
+    } else if (option == "--trace-file") {
+      traceFile = argv[i + 1];
+    } else {
+      printHelp();
+      return 0;
+    }
+  }
+
+  if (mode.empty()) {
+    printHelp();
+    return 0;
+  }
 
   /**
    * Program to execute.
    */
-  std::string program;
+  std::string_view program;
 
   /**
    * Simple expression.
    */
   if (mode == "-e") {
-    program = argv[2];
+    program = input;
   }
 
   /**
-   * Eva file.
+   * Eva file (parsed in place from the mapping).
    */
-  else if (mode == "-f") {
-    // Read the file:
-    std::ifstream programFile(argv[2]);
-    std::stringstream buffer;
-    buffer << programFile.rdbuf() << "\n";
-
-    // Program:
-    program = buffer.str();
+  SourceFile sourceFile;
+  if (mode == "-f") {
+    if (!sourceFile.open(input)) {
+      std::cerr << "Can't read file " << input << "\n";
+      return 1;
+    }
+    program = sourceFile.text;
   }
 
   /**
@@ -71,14 +147,78 @@ int main(int argc, char const *argv[]) {
    */
   EvaVM vm;
 
+  /**
+   * Tracing (quiet unless enabled).
+   */
+  if (!traceCategories.empty()) {
+    if (!Tracer::parseCategories(traceCategories, vm.tracer.categories) ||
+        (traceLevel != "info" && traceLevel != "verbose")) {
+      printHelp();
+      return 0;
+    }
+    vm.tracer.level =
+        traceLevel == "verbose" ? TraceLevel::VERBOSE : TraceLevel::INFO;
+  }
+  if (!traceFile.empty()) {
+    auto fd = open(traceFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      std::cerr << "Can't write trace " << traceFile << "\n";
+      return 1;
+    }
+    vm.tracer.setOutput(fd);
+  }
+
+  /**
+   * Start from the heap snapshot.
+   */
+  if (!snapshotFile.empty() && !vm.restoreSnapshot(snapshotFile)) {
+    std::cerr << "Invalid snapshot " << snapshotFile << "\n";
+    return 1;
+  }
+
+  /**
+   * Sample the program.
+   */
+  if (!profileFile.empty() && !vm.sampler.start()) {
+    std::cerr << "Can't start the profiler\n";
+    return 1;
+  }
+
   /**
    * Evaluation result.
    */
-  auto result = vm.exec(program);
+  auto result = cacheFile.empty() ? vm.exec(program)
+                                  : vm.execCached(program, cacheFile);
 
   std::cout << "\n";
-  log(result);
+  LOG(result);
   std::cout << "\n";
 
+  /**
+   * Folded stacks dump.
+   */
+  if (!profileFile.empty()) {
+    vm.sampler.stop();
+    if (!vm.sampler.save(profileFile)) {
+      std::cerr << "Can't write profile " << profileFile << "\n";
+      return 1;
+    }
+  }
+
+  /**
+   * Heap snapshot after the program.
+   */
+  if (!makeSnapshotFile.empty() && !vm.saveSnapshot(makeSnapshotFile)) {
+    std::cerr << "Can't write snapshot " << makeSnapshotFile << "\n";
+    return 1;
+  }
+
+  /**
+   * GC telemetry dump.
+   */
+  if (!gcStatsFile.empty()) {
+    std::ofstream(gcStatsFile) << vm.gcStats.toJSON();
+  }
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+#!/bin/sh
+#
+# Eva-level checks: each program evaluates to true (test.eva to 60).
+#
+#   ./run-tests.sh [path/to/eva-vm] [path/to/test-bind] [path/to/eva-pool]
+#
+
+VM=${1:-./eva-vm}
+BIND=${2:-./test-bind}
+POOL=${3:-./eva-pool}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+# run <program> <name> <expected line> <args>...
+#
+# Some output line should be the expected line exactly; a trailing "..."
+# matches any rest of the line.
+run() {
+  program=$1
+  name=$2
+  expected=$3
+  shift 3
+  if "$program" "$@" 2>&1 | awk -v e="$expected" '
+      substr(e, length(e) - 2) == "..." { if (index($0, substr(e, 1, length(e) - 3)) == 1) found = 1; next }
+      $0 == e { found = 1 }
+      END { exit !found }'; then
+    echo "ok    $name"
+  else
+    echo "FAIL  $name"
+    FAILED=1
+  fi
+}
+
+# check <name> <expected output> <eva-vm args>...
+check() {
+  run "$VM" "$@"
+}
+
+check "classes" "result = EvaValue (NUMBER): 60" -f test.eva
+check "host calls" "result = EvaValue (BOOLEAN): true" -f test-call.eva
+check "maps" "result = EvaValue (BOOLEAN): true" -f test-map.eva
+check "inlining" "result = EvaValue (BOOLEAN): true" -f test-inline.eva
+check "scopes" "result = EvaValue (BOOLEAN): true" -f test-scope.eva
+check "literals" "result = EvaValue (BOOLEAN): true" -f test-literals.eva
+check "f64 kernels" "result = EvaValue (BOOLEAN): true" -f test-f64.eva
+check "fibers" "result = EvaValue (BOOLEAN): true" -f test-fiber.eva
+check "io" "result = EvaValue (BOOLEAN): true" -f test-io.eva
+check "channels" "result = EvaValue (BOOLEAN): true" -f test-channel.eva
+
+# Bytecode cache: the first run writes the cache, the second loads it
+check "cache (write)" "result = EvaValue (NUMBER): 60" -f test.eva -c "$TMP/test.evac"
+check "cache (load)" "result = EvaValue (NUMBER): 60" -f test.eva -c "$TMP/test.evac"
+check "cache (maps)" "result = EvaValue (BOOLEAN): true" -f test-map.eva -c "$TMP/test-map.evac"
+check "cache (maps, load)" "result = EvaValue (BOOLEAN): true" -f test-map.eva -c "$TMP/test-map.evac"
+
+# Heap snapshot: the second program runs on the heap of the first one
+check "snapshot (save)" "result = EvaValue (BOOLEAN): true" -f test-snapshot.eva --make-snapshot "$TMP/test.evas"
+check "snapshot (restore)" "result = EvaValue (BOOLEAN): true" -f test-snapshot-restore.eva --snapshot "$TMP/test.evas"
+
+# Float64Array kernels need the same lengths
+check "f64 (length mismatch)" "Fatal error: [EvaVM]: f64-add: length mismatch 3 != 2" -e '(f64-add (f64-array 2) (f64-array 2) (f64-array 3))'
+
+# Parse errors
+check "bad number" "Fatal error: Syntax error at line 1 (byte 0): Invalid number: 0x" -e '0x'
+check "unclosed list" "Fatal error: Syntax error at line 1 (byte 4): Unexpected end of input, list opened at line 1 is not closed" -e '(+ 1'
+
+# Fibers that only wait for each other
+check "fibers (deadlock)" "Fatal error: [EvaVM]: Deadlock: all fibers are waiting" -e '(begin (var fibers (array)) (def wait-other (i) (begin (yield) (await (index fibers i)))) (push fibers (spawn (wait-other 1))) (push fibers (spawn (wait-other 0))) (await (index fibers 0)))'
+
+# Runtime errors print the offending value as is
+check "index error" "Fatal error: [EvaVM]: Index 5 is out of bounds of array[2]" -e '(index (array 1 2) 5)'
+check "number check" "Fatal error: [EvaVM]: channel: expected a number, got STRING" -e '(channel "jobs" "64")'
+
+# Channels: functions belong to their isolate
+check "channel (clone error)" "Fatal error: [Channel]: Can't send FUNCTION to another isolate" -e '(send (channel "local" 1) (lambda (x) x))'
+
+# Event loop: a file written and read back
+check "io (files)" 'result = EvaValue (STRING): "hello"' -e "(begin (var n (write-file \"$TMP/io.txt\" \"hello\")) (if (== n 5) (read-file \"$TMP/io.txt\") false))"
+# Event loop: a write to a closed pipe fails instead of raising SIGPIPE
+check "closed pipe" "Fatal error: [EventLoop]: Write to fd ..." -e '(begin (var p (pipe)) (fd-close (index p 0)) (fd-write (index p 1) "x"))'
+
+# Bound natives (test-bind.cpp): more natives than a 1-byte global
+# index addresses, and the argument conversions
+if [ -x "$BIND" ]; then
+  run "$BIND" "bind (300 natives)" "result = EvaValue (NUMBER): 101" "(last 1)"
+  run "$BIND" "bind (string)" 'result = EvaValue (STRING): "hi!"' '(shout "hi")'
+  run "$BIND" "bind (out of range)" "Fatal error: [EvaVM]: byte: argument 1 expects an integer in the range of the bound type, got 300" "(byte 300)"
+  run "$BIND" "bind (fraction)" "Fatal error: [EvaVM]: byte: argument 1 expects an integer in the range of the bound type, got 1.5" "(byte 1.5)"
+  run "$BIND" "bind (type)" "Fatal error: [EvaVM]: byte: argument 1 expects a number, got STRING" '(byte "a")'
+else
+  echo "skip  bind ($BIND not built)"
+fi
+
+# Worker pool: a runtime error fails its job only
+if [ -x "$POOL" ]; then
+  run "$POOL" "pool (runtime error)" "Jobs       : 2 completed, 1 failed" -w 2 "(+ 1 2)" "(index (array 1) 5)" "(* 3 4)"
+  # The first job waits for the message the second worker sends
+  run "$POOL" "pool (channel)" "Jobs       : 2 completed, 0 failed" -w 2 \
+    '(begin (var got (receive (channel "pool" 4))) (if (== (f64-sum (index got 1)) 5) (len got) (index (array) 5)))' \
+    '(send (channel "pool" 4) (array 1 (f64-from (array 2 3))))'
+else
+  echo "skip  pool ($POOL not built)"
+fi
+
+exit $FAILED
@@ -15,18 +15,112 @@
 #ifndef Logger_h
 #define Logger_h
 
+#include <cstdlib>
+#include <functional>
+#include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 
-class ErrorLogMessage : public std::basic_ostringstream<char> {
+/**
+ * Source position of the running code (compiled expression, or the
+ * executing frames), printed after a fatal error. Formatted lazily,
+ * only when an error is reported.
+ */
+inline thread_local std::function<std::string()> currentErrorContext;
+
+/**
+ * Sets the error context for the scope (restores the previous one).
+ */
+class ErrorContext {
+ public:
+  ErrorContext(std::function<std::string()> context)
+      : prev_(std::move(currentErrorContext)) {
+    currentErrorContext = std::move(context);
+  }
+
+  ~ErrorContext() { currentErrorContext = std::move(prev_); }
+
+  ErrorContext(const ErrorContext&) = delete;
+  ErrorContext& operator=(const ErrorContext&) = delete;
+
+ private:
+  std::function<std::string()> prev_;
+};
+
+/**
+ * Fatal error thrown by DIE (instead of exiting the process) on a
+ * thread with an ErrorHandler. The message includes the context.
+ */
+class EvaError : public std::runtime_error {
  public:
-  ~ErrorLogMessage() {
-    std::cerr << "Fatal error: " << str().c_str();
+  using std::runtime_error::runtime_error;
+};
+
+/**
+ * Whether fatal errors of the thread throw EvaError.
+ */
+inline thread_local bool throwFatalErrors = false;
+
+/**
+ * Makes fatal errors throw EvaError for the scope, so an embedder
+ * (e.g. a worker running many jobs on an isolate) handles them per
+ * job. The VM stays usable: the next run starts from a new root
+ * fiber with empty stacks.
+ */
+class ErrorHandler {
+ public:
+  ErrorHandler() : prev_(throwFatalErrors) { throwFatalErrors = true; }
+
+  ~ErrorHandler() { throwFatalErrors = prev_; }
+
+  ErrorHandler(const ErrorHandler&) = delete;
+  ErrorHandler& operator=(const ErrorHandler&) = delete;
+
+ private:
+  bool prev_;
+};
+
+class ErrorLogMessage {
+ public:
+  // Not a stream subclass: the stream destructor is noexcept
+  template <typename T>
+  ErrorLogMessage& operator<<(const T& value) {
+    stream_ << value;
+    return *this;
+  }
+
+  ErrorLogMessage& operator<<(std::ostream& (*manipulator)(std::ostream&)) {
+    stream_ << manipulator;
+    return *this;
+  }
+
+  ErrorLogMessage& operator<<(std::ios_base& (*manipulator)(std::ios_base&)) {
+    stream_ << manipulator;
+    return *this;
+  }
+
+  ~ErrorLogMessage() noexcept(false) {
+    if (throwFatalErrors) {
+      auto message = stream_.str();
+      if (currentErrorContext) {
+        message += "\n" + currentErrorContext();
+      }
+      throw EvaError(message);
+    }
+    std::cerr << "Fatal error: " << stream_.str();
+    if (currentErrorContext) {
+      std::cerr << "\n" << currentErrorContext() << "\n";
+    }
     exit(EXIT_FAILURE);
   }
+
+ private:
+  std::ostringstream stream_;
 };
 
 #define DIE ErrorLogMessage()
 
-#define log(value) std::cout << #value << " = " << (value) << "\n";
+#define LOG(value) std::cout << #value << " = " << (value) << "\n";
 
 #endif
\ No newline at end of file
@@ -0,0 +1,217 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Tracing: debug output by category and level.
+ */
+
+#ifndef Tracer_h
+#define Tracer_h
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/**
+ * Compile-time disable: define EVA_NO_TRACE to compile
+ * all the trace statements out.
+ */
+// #define EVA_NO_TRACE
+
+/**
+ * Size of the trace output buffer.
+ */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Trace categories (bit flags).
+ */
+enum TraceCategory : uint32_t {
+  TRACE_DISASM = 1 << 0,
+  TRACE_GC = 1 << 1,
+  TRACE_CALLS = 1 << 2,
+  TRACE_ALL = 0xFFFFFFFF,
+};
+
+/**
+ * Trace levels: QUIET writes nothing, INFO writes the disassembly
+ * and GC cycles, VERBOSE adds per-cycle details and every call.
+ */
+enum class TraceLevel {
+  QUIET,
+  INFO,
+  VERBOSE,
+};
+
+/**
+ * Writes a trace message. The message is formatted only if the
+ * category is enabled at the level (never with EVA_NO_TRACE).
+ */
+#define TRACE(tracer, category, level) \
+  if (!(tracer).enabled(category, level)) {} else (tracer).out()
+
+/**
+ * Tracer: buffered trace output to a file descriptor.
+ *
+ * Quiet by default, so the execution does no formatting work.
+ * A fatal error exits without destroying the VM, so the live
+ * tracers are also flushed at exit.
+ */
+class Tracer {
+ public:
+  Tracer() : out_(&buffer_) {
+      std::lock_guard<std::mutex> lock(liveMutex_);
+      if (!flushAtExit_) {
+          std::atexit(flushAll);
+          flushAtExit_ = true;
+      }
+      live_.push_back(this);
+  }
+
+  ~Tracer() {
+      flush();
+      std::lock_guard<std::mutex> lock(liveMutex_);
+      live_.erase(std::find(live_.begin(), live_.end(), this));
+  }
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  /**
+   * Whether the category is traced at the level.
+   */
+  bool enabled(uint32_t category, TraceLevel level) const {
+#ifdef EVA_NO_TRACE
+      return false;
+#else
+      return level <= this->level && (categories & category) != 0;
+#endif
+  }
+
+  /**
+   * Output stream (buffered).
+   */
+  std::ostream& out() { return out_; }
+
+  /**
+   * Writes the buffered output.
+   */
+  void flush() { out_.flush(); }
+
+  /**
+   * Redirects the output (the pending output goes to the previous one).
+   */
+  void setOutput(int fd) {
+      flush();
+      buffer_.fd = fd;
+  }
+
+  /**
+   * Parses a comma separated list of categories (disasm, gc,
+   * calls, all), returns false on an unknown category.
+   */
+  static bool parseCategories(const std::string& list, uint32_t& categories) {
+      categories = 0;
+      std::istringstream names(list);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+          if (name == "disasm") {
+              categories |= TRACE_DISASM;
+          } else if (name == "gc") {
+              categories |= TRACE_GC;
+          } else if (name == "calls") {
+              categories |= TRACE_CALLS;
+          } else if (name == "all") {
+              categories |= TRACE_ALL;
+          } else {
+              return false;
+          }
+      }
+      return true;
+  }
+
+  /**
+   * Enabled level and categories.
+   */
+  TraceLevel level = TraceLevel::QUIET;
+  uint32_t categories = TRACE_ALL;
+
+ private:
+  /**
+   * Stream buffer writing to the file descriptor when full or flushed.
+   */
+  struct FdBuffer : public std::streambuf {
+      FdBuffer() : data(TRACE_BUFFER_SIZE) {
+          setp(data.data(), data.data() + data.size());
+      }
+
+      int overflow(int c) override {
+          if (sync() != 0) {
+              return traits_type::eof();
+          }
+          if (c != traits_type::eof()) {
+              *pptr() = (char)c;
+              pbump(1);
+          }
+          return traits_type::not_eof(c);
+      }
+
+      int sync() override {
+          auto pos = pbase();
+          while (pos < pptr()) {
+              auto count = ::write(fd, pos, pptr() - pos);
+              if (count < 0 && errno == EINTR) {
+                  continue;
+              }
+              if (count <= 0) {
+                  break;
+              }
+              pos += count;
+          }
+          auto failed = pos < pptr();
+          setp(data.data(), data.data() + data.size());
+          return failed ? -1 : 0;
+      }
+
+      std::vector<char> data;
+      int fd = STDERR_FILENO;
+  };
+
+  /**
+   * Flushes the live tracers (at exit).
+   */
+  static void flushAll() {
+      std::lock_guard<std::mutex> lock(liveMutex_);
+      for (auto tracer : live_) {
+          tracer->flush();
+      }
+  }
+
+  FdBuffer buffer_;
+  std::ostream out_;
+
+  /**
+   * Live tracers, flushed at exit.
+   */
+  static inline std::mutex liveMutex_;
+  static inline std::vector<Tracer*> live_;
+  static inline bool flushAtExit_ = false;
+};
+
+#endif
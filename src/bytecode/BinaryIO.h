@@ -0,0 +1,203 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Binary I/O for the serialized formats (bytecode cache, heap snapshot).
+ */
+
+#ifndef BinaryIO_h
+#define BinaryIO_h
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Binary writer: appends to an in-memory buffer.
+ */
+struct BinaryWriter {
+  void u8(uint8_t value) { data.push_back((char)value); }
+
+  void u32(uint32_t value) { bytes(&value, sizeof(value)); }
+
+  void u64(uint64_t value) { bytes(&value, sizeof(value)); }
+
+  void f64(double value) { bytes(&value, sizeof(value)); }
+
+  void string(const std::string& value) {
+      u32(value.size());
+      data.append(value);
+  }
+
+  void bytes(const void* bytes, size_t count) {
+      data.append((const char*)bytes, count);
+  }
+
+  /**
+   * Writes the buffer to the file: to a temporary file in the same
+   * directory, renamed over the target. The file may be mapped by
+   * another process (see MappedFiles), which keeps the old contents
+   * instead of seeing a truncated or half-written file.
+   */
+  bool writeFile(const std::string& fileName) {
+      std::string tempName = fileName + ".XXXXXX";
+      auto fd = mkstemp(tempName.data());
+      if (fd == -1) {
+          return false;
+      }
+      auto ok = fchmod(fd, 0644) == 0;
+      for (size_t written = 0; ok && written < data.size();) {
+          auto count = ::write(fd, data.data() + written, data.size() - written);
+          if (count < 0 && errno == EINTR) {
+              continue;
+          }
+          ok = count > 0;
+          written += ok ? count : 0;
+      }
+      ok = ::close(fd) == 0 && ok;
+      if (!ok || rename(tempName.c_str(), fileName.c_str()) != 0) {
+          unlink(tempName.c_str());
+          return false;
+      }
+      return true;
+  }
+
+  /**
+   * Output buffer.
+   */
+  std::string data;
+};
+
+/**
+ * Binary reader: reads in place from a memory range, and
+ * fails (instead of overrunning) on malformed input.
+ */
+struct BinaryReader {
+  BinaryReader(const uint8_t* pos, const uint8_t* end) : pos(pos), end(end) {}
+
+  /**
+   * Returns the bytes in place, nullptr on overrun.
+   */
+  const uint8_t* bytes(size_t count) {
+      if (!ok || (size_t)(end - pos) < count) {
+          ok = false;
+          return nullptr;
+      }
+      auto bytes = pos;
+      pos += count;
+      return bytes;
+  }
+
+  uint8_t u8() {
+      auto bytes = this->bytes(1);
+      return bytes == nullptr ? 0 : *bytes;
+  }
+
+  uint32_t u32() { return read<uint32_t>(); }
+
+  uint64_t u64() { return read<uint64_t>(); }
+
+  double f64() { return read<double>(); }
+
+  /**
+   * Reads a list size, bounded by the remaining bytes.
+   */
+  uint32_t count() {
+      auto count = u32();
+      if (count > (size_t)(end - pos)) {
+          ok = false;
+          return 0;
+      }
+      return count;
+  }
+
+  std::string string() {
+      auto size = u32();
+      auto bytes = this->bytes(size);
+      return bytes == nullptr ? "" : std::string((const char*)bytes, size);
+  }
+
+  template <typename T>
+  T read() {
+      T value{};
+      auto bytes = this->bytes(sizeof(T));
+      if (bytes != nullptr) {
+          std::memcpy(&value, bytes, sizeof(T));
+      }
+      return value;
+  }
+
+  const uint8_t* pos;
+  const uint8_t* end;
+
+  /**
+   * Whether all reads succeeded.
+   */
+  bool ok = true;
+};
+
+/**
+ * Read-only file mappings, unmapped on destruction.
+ */
+struct MappedFiles {
+  ~MappedFiles() {
+      for (auto& [data, size] : mappings) {
+          munmap(data, size);
+      }
+  }
+
+  /**
+   * Maps the file, returns nullptr if it's missing or shorter than minSize.
+   */
+  uint8_t* map(const std::string& fileName, size_t& size, size_t minSize = 1) {
+      auto fd = open(fileName.c_str(), O_RDONLY);
+      if (fd == -1) {
+          return nullptr;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0 || (size_t)st.st_size < minSize) {
+          close(fd);
+          return nullptr;
+      }
+      size = (size_t)st.st_size;
+      auto data = (uint8_t*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (data == MAP_FAILED) {
+          return nullptr;
+      }
+      mappings.push_back({data, size});
+      return data;
+  }
+
+  /**
+   * Unmaps the last mapped file (e.g. if it turned out invalid).
+   */
+  void unmapLast() {
+      auto [data, size] = mappings.back();
+      munmap(data, size);
+      mappings.pop_back();
+  }
+
+  /**
+   * Mapped files (data, size).
+   */
+  std::vector<std::pair<uint8_t*, size_t>> mappings;
+};
+
+#endif
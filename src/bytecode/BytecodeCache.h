@@ -0,0 +1,435 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Bytecode cache (.evac files).
+ */
+
+#ifndef BytecodeCache_h
+#define BytecodeCache_h
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../vm/EvaValue.h"
+#include "../vm/Global.h"
+#include "BinaryIO.h"
+
+/**
+ * File magic.
+ */
+#define EVAC_MAGIC "EVAC"
+
+/**
+ * Format version, bumped on any change of the layout or the ISA.
+ */
+#define EVAC_VERSION 7
+
+/**
+ * Index of a missing class (no super class).
+ */
+#define EVAC_NO_INDEX 0xFFFFFFFF
+
+/**
+ * Cache file header.
+ *
+ * Followed by the sections:
+ *
+ *   globals: <name>*
+ *   code:    (<name> arity freeCount isAsync <cellName>* <local>* <const>* <bytes>
+ *             line <lineTable>)*
+ *   classes: (<name> superIndex (<prop> <value>)*)*
+ *
+ * Strings and lists are prefixed with u32 size. Code object 0 is
+ * the main entry point. Bytecode is used in place from the mapping.
+ */
+struct EvacHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceHash;
+  uint32_t globalsCount;
+  uint32_t codeCount;
+  uint32_t classesCount;
+  uint32_t reserved;
+};
+
+/**
+ * Serialized value tag.
+ */
+enum class EvacValueTag : uint8_t {
+  NUMBER,
+  BOOLEAN,
+  STRING,
+  CODE,
+  FUNCTION,
+  CLASS,
+};
+
+/**
+ * Bytecode cache: writes compiled programs, and loads them
+ * back via mmap, skipping parsing and compilation.
+ */
+class BytecodeCache {
+ public:
+  BytecodeCache(std::shared_ptr<Global> global) : global(global) {}
+
+  /**
+   * Source hash (FNV-1a).
+   */
+  static uint64_t hashSource(std::string_view source) {
+      uint64_t hash = 14695981039346656037ull;
+      for (auto c : source) {
+          hash ^= (uint8_t)c;
+          hash *= 1099511628211ull;
+      }
+      return hash;
+  }
+
+  /**
+   * Writes the program of the main function to the cache file.
+   *
+   * Returns false if the program can't be cached (e.g. it
+   * references runtime objects).
+   */
+  bool write(const std::string& fileName, uint64_t sourceHash,
+             FunctionObject* main) {
+      codeIndex_.clear();
+      classIndex_.clear();
+      codeObjects_.clear();
+      classes_.clear();
+      ok_ = true;
+      collectCode(main->co);
+      if (!ok_) {
+          return false;
+      }
+      BinaryWriter out;
+      EvacHeader header{};
+      std::memcpy(header.magic, EVAC_MAGIC, 4);
+      header.version = EVAC_VERSION;
+      header.sourceHash = sourceHash;
+      header.globalsCount = global->globals.size();
+      header.codeCount = codeObjects_.size();
+      header.classesCount = classes_.size();
+      out.bytes(&header, sizeof(header));
+      // Globals
+      for (const auto& globalVar : global->globals) {
+          out.string(globalVar.name);
+      }
+      // Code objects
+      for (const auto& co : codeObjects_) {
+          out.string(co->name);
+          out.u32(co->arity);
+          out.u32(co->freeCount);
+          out.u8(co->isAsync);
+          out.u32(co->cellNames.size());
+          for (const auto& cellName : co->cellNames) {
+              out.string(cellName);
+          }
+          out.u32(co->locals.size());
+          for (const auto& local : co->locals) {
+              out.string(local.name);
+              out.u32(local.scopeLevel);
+          }
+          out.u32(co->constants.size());
+          for (const auto& constant : co->constants) {
+              writeValue(out, constant);
+          }
+          out.u32(co->getCodeSize());
+          out.bytes(co->getCode(), co->getCodeSize());
+          out.u32(co->line);
+          out.u32(co->lineTable.size());
+          out.bytes(co->lineTable.data(), co->lineTable.size());
+      }
+      // Classes
+      for (const auto& cls : classes_) {
+          out.string(cls->name);
+          out.u32(cls->superClass == nullptr ? EVAC_NO_INDEX
+                                             : classIndex_[cls->superClass]);
+          out.u32(cls->properties.size());
+          for (const auto& [name, value] : cls->properties) {
+              out.string(name);
+              writeValue(out, value);
+          }
+      }
+      return out.writeFile(fileName);
+  }
+
+  /**
+   * Loads a program from the cache file.
+   *
+   * Returns the main function, or nullptr if the file is missing,
+   * stale (different source, version or globals) or malformed.
+   */
+  FunctionObject* load(const std::string& fileName, uint64_t sourceHash) {
+      size_t size;
+      auto data = files_.map(fileName, size, sizeof(EvacHeader));
+      if (data == nullptr) {
+          return nullptr;
+      }
+      auto main = loadMapped(data, size, sourceHash);
+      // Otherwise code objects reference the bytecode in the mapping
+      if (main == nullptr) {
+          files_.unmapLast();
+      }
+      return main;
+  }
+
+ private:
+  /**
+   * Loads the program from the mapped file.
+   */
+  FunctionObject* loadMapped(uint8_t* data, size_t size, uint64_t sourceHash) {
+      EvacHeader header;
+      std::memcpy(&header, data, sizeof(header));
+      if (std::memcmp(header.magic, EVAC_MAGIC, 4) != 0 ||
+          header.version != EVAC_VERSION || header.sourceHash != sourceHash ||
+          header.codeCount == 0) {
+          return nullptr;
+      }
+      BinaryReader in(data + sizeof(header), data + size);
+      // Global indices are baked into the bytecode, so the VM globals
+      // should be a prefix of (or equal to) the cached ones
+      std::vector<std::string> globalNames(header.globalsCount);
+      for (auto& name : globalNames) {
+          name = in.string();
+      }
+      if (!in.ok || globalNames.size() < global->globals.size()) {
+          return nullptr;
+      }
+      for (size_t i = 0; i < global->globals.size(); i++) {
+          if (global->globals[i].name != globalNames[i]) {
+              return nullptr;
+          }
+      }
+      // Object shells, so the values can reference them in any order
+      loadedCode_.clear();
+      loadedClasses_.clear();
+      for (uint32_t i = 0; i < header.codeCount; i++) {
+          loadedCode_.push_back(AS_CODE(ALLOC_CODE("", 0)));
+      }
+      for (uint32_t i = 0; i < header.classesCount; i++) {
+          loadedClasses_.push_back(AS_CLASS(ALLOC_CLASS("", nullptr)));
+      }
+      // Code objects
+      for (auto& co : loadedCode_) {
+          co->name = in.string();
+          co->arity = in.u32();
+          co->freeCount = in.u32();
+          co->isAsync = in.u8() != 0;
+          co->cellNames.resize(in.count());
+          for (auto& cellName : co->cellNames) {
+              cellName = in.string();
+          }
+          co->locals.resize(in.count());
+          for (auto& local : co->locals) {
+              local.name = in.string();
+              local.scopeLevel = in.u32();
+          }
+          co->constants.resize(in.count());
+          for (auto& constant : co->constants) {
+              constant = readValue(in);
+          }
+          co->mappedCodeSize = in.u32();
+          co->mappedCode = (uint8_t*)in.bytes(co->mappedCodeSize);
+          co->line = in.u32();
+          auto lineTableSize = in.count();
+          auto lineTable = in.bytes(lineTableSize);
+          if (lineTable != nullptr) {
+              co->lineTable.assign(lineTable, lineTable + lineTableSize);
+          }
+      }
+      // Classes
+      for (auto& cls : loadedClasses_) {
+          cls->name = in.string();
+          auto superIndex = in.u32();
+          if (superIndex != EVAC_NO_INDEX) {
+              if (superIndex >= loadedClasses_.size()) {
+                  in.ok = false;
+                  break;
+              }
+              cls->superClass = loadedClasses_[superIndex];
+          }
+          auto propsCount = in.count();
+          for (uint32_t i = 0; i < propsCount && in.ok; i++) {
+              auto name = in.string();
+              cls->properties[name] = readValue(in);
+          }
+      }
+      if (!in.ok) {
+          // The shells are garbage, and shouldn't reference the
+          // mapping, which is unmapped
+          for (auto& co : loadedCode_) {
+              co->mappedCode = nullptr;
+              co->mappedCodeSize = 0;
+          }
+          return nullptr;
+      }
+      // The whole file is valid: define the globals of the program
+      for (size_t i = global->globals.size(); i < globalNames.size(); i++) {
+          global->define(globalNames[i]);
+      }
+      // Classes are installed to the globals at compile time
+      for (auto& cls : loadedClasses_) {
+          auto globalIndex = global->getGlobalIndex(cls->name);
+          if (globalIndex != -1) {
+              global->set(globalIndex, OBJECT((Object*)cls));
+          }
+      }
+      return AS_FUNCTION(ALLOC_FUNCTION(loadedCode_[0]));
+  }
+
+  /**
+   * Collects code objects and classes reachable from the code.
+   */
+  void collectCode(CodeObject* co) {
+      if (codeIndex_.count(co) != 0) {
+          return;
+      }
+      codeIndex_[co] = codeObjects_.size();
+      codeObjects_.push_back(co);
+      for (const auto& constant : co->constants) {
+          collectValue(constant);
+      }
+  }
+
+  /**
+   * Collects objects referenced by the value.
+   */
+  void collectValue(const EvaValue& value) {
+      if (IS_NUMBER(value) || IS_BOOLEAN(value) || IS_STRING(value)) {
+          return;
+      }
+      if (IS_CODE(value)) {
+          collectCode(AS_CODE(value));
+      } else if (IS_FUNCTION(value) && AS_FUNCTION(value)->cells.empty()) {
+          collectCode(AS_FUNCTION(value)->co);
+      } else if (IS_CLASS(value)) {
+          collectClass(AS_CLASS(value));
+      } else {
+          // Runtime objects (closures, instances, etc)
+          ok_ = false;
+      }
+  }
+
+  /**
+   * Collects a class, its super class and methods.
+   */
+  void collectClass(ClassObject* cls) {
+      if (classIndex_.count(cls) != 0) {
+          return;
+      }
+      classIndex_[cls] = classes_.size();
+      classes_.push_back(cls);
+      if (cls->superClass != nullptr) {
+          collectClass(cls->superClass);
+      }
+      for (const auto& prop : cls->properties) {
+          collectValue(prop.second);
+      }
+  }
+
+  /**
+   * Writes a value.
+   */
+  void writeValue(BinaryWriter& out, const EvaValue& value) {
+      if (IS_NUMBER(value)) {
+          out.u8((uint8_t)EvacValueTag::NUMBER);
+          out.f64(AS_NUMBER(value));
+      } else if (IS_BOOLEAN(value)) {
+          out.u8((uint8_t)EvacValueTag::BOOLEAN);
+          out.u8(AS_BOOLEAN(value));
+      } else if (IS_STRING(value)) {
+          out.u8((uint8_t)EvacValueTag::STRING);
+          out.string(AS_CPPSTRING(value));
+      } else if (IS_CODE(value)) {
+          out.u8((uint8_t)EvacValueTag::CODE);
+          out.u32(codeIndex_[AS_CODE(value)]);
+      } else if (IS_FUNCTION(value)) {
+          out.u8((uint8_t)EvacValueTag::FUNCTION);
+          out.u32(codeIndex_[AS_FUNCTION(value)->co]);
+      } else if (IS_CLASS(value)) {
+          out.u8((uint8_t)EvacValueTag::CLASS);
+          out.u32(classIndex_[AS_CLASS(value)]);
+      }
+  }
+
+  /**
+   * Reads a value.
+   */
+  EvaValue readValue(BinaryReader& in) {
+      auto tag = (EvacValueTag)in.u8();
+      switch (tag) {
+          case EvacValueTag::NUMBER:
+              return NUMBER(in.f64());
+          case EvacValueTag::BOOLEAN:
+              return BOOLEAN(in.u8() != 0);
+          case EvacValueTag::STRING:
+              return ALLOC_STRING(in.string());
+          case EvacValueTag::CODE: {
+              auto index = in.u32();
+              if (index < loadedCode_.size()) {
+                  return OBJECT((Object*)loadedCode_[index]);
+              }
+              break;
+          }
+          case EvacValueTag::FUNCTION: {
+              auto index = in.u32();
+              if (index < loadedCode_.size()) {
+                  return ALLOC_FUNCTION(loadedCode_[index]);
+              }
+              break;
+          }
+          case EvacValueTag::CLASS: {
+              auto index = in.u32();
+              if (index < loadedClasses_.size()) {
+                  return OBJECT((Object*)loadedClasses_[index]);
+              }
+              break;
+          }
+      }
+      in.ok = false;
+      return NUMBER(0);
+  }
+
+  /**
+   * Global object.
+   */
+  std::shared_ptr<Global> global;
+
+  /**
+   * Writer state: indices of the collected objects.
+   */
+  std::map<CodeObject*, uint32_t> codeIndex_;
+  std::map<ClassObject*, uint32_t> classIndex_;
+  std::vector<CodeObject*> codeObjects_;
+  std::vector<ClassObject*> classes_;
+
+  /**
+   * Reader state: loaded objects by index.
+   */
+  std::vector<CodeObject*> loadedCode_;
+  std::vector<ClassObject*> loadedClasses_;
+
+  /**
+   * Whether the collected program can be cached.
+   */
+  bool ok_ = true;
+
+  /**
+   * Mapped cache files.
+   */
+  MappedFiles files_;
+};
+
+#endif
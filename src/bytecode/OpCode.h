@@ -123,6 +123,76 @@
  */
 #define OP_SET_PROP 0x17
 
+/**
+ * Returns a local variable of an enclosing frame
+ * (used by non-escaping functions).
+ */
+#define OP_GET_PARENT_LOCAL 0x18
+
+/**
+ * Sets a local variable of an enclosing frame.
+ */
+#define OP_SET_PARENT_LOCAL 0x19
+
+/**
+ * Creates an array of the values on the stack: OP_ARRAY_NEW <count>
+ */
+#define OP_ARRAY_NEW 0x1A
+
+/**
+ * Array element read.
+ */
+#define OP_INDEX_GET 0x1B
+
+/**
+ * Array element write.
+ */
+#define OP_INDEX_SET 0x1C
+
+/**
+ * Length of an array or a string.
+ */
+#define OP_LEN 0x1D
+
+/**
+ * Creates a map of the key/value pairs on the stack: OP_MAP_NEW <count>
+ */
+#define OP_MAP_NEW 0x1E
+
+/**
+ * Whether the map has the key.
+ */
+#define OP_MAP_HAS 0x1F
+
+/**
+ * Deletes the key from the map.
+ */
+#define OP_MAP_DELETE 0x20
+
+/**
+ * Map iteration: the next entry cursor, and the key and the value
+ * of the entry at the cursor.
+ */
+#define OP_MAP_NEXT 0x21
+#define OP_MAP_KEY 0x22
+#define OP_MAP_VALUE 0x23
+
+/**
+ * Spawns a fiber calling the function with the arguments
+ * on the stack: OP_SPAWN <argsCount>
+ */
+#define OP_SPAWN 0x24
+
+/**
+ * Suspends the current fiber until the awaited one is done.
+ */
+#define OP_AWAIT 0x25
+
+/**
+ * Moves the current fiber to the end of the ready queue.
+ */
+#define OP_YIELD 0x26
+
 // -----------------------------------------------------------
 
 #define OP_STR(op)	\
@@ -155,6 +225,21 @@ std::string opcodeToString(uint8_t opcode) {
 		OP_STR(NEW);
 		OP_STR(GET_PROP);
 		OP_STR(SET_PROP);
+		OP_STR(GET_PARENT_LOCAL);
+		OP_STR(SET_PARENT_LOCAL);
+		OP_STR(ARRAY_NEW);
+		OP_STR(INDEX_GET);
+		OP_STR(INDEX_SET);
+		OP_STR(LEN);
+		OP_STR(MAP_NEW);
+		OP_STR(MAP_HAS);
+		OP_STR(MAP_DELETE);
+		OP_STR(MAP_NEXT);
+		OP_STR(MAP_KEY);
+		OP_STR(MAP_VALUE);
+		OP_STR(SPAWN);
+		OP_STR(AWAIT);
+		OP_STR(YIELD);
 		default:
 			DIE << "opcodeToString: unknown opcode: " << std::hex << (int)opcode;
 	}
@@ -20,9 +20,10 @@
 #include <string>
 
 #include "../disassembler/EvaDisassembler.h"
-#include "../parser/EvaParser.h"
+#include "../parser/Exp.h"
 #include "../vm/EvaValue.h"
 #include "../vm/Global.h"
+#include "Inliner.h"
 #include "Scope.h"
 
  // -----------------------------------------------------------------
@@ -31,14 +32,14 @@
 #define ALLOC_CONST(tester, converter, allocator, value)    \
 do {                                                        \
     for (auto i = 0; i < co->constants.size(); i++) {       \
-        if (!IS_STRING(co->constants[i])) {                 \
+        if (!tester(co->constants[i])) {                    \
             continue;                                       \
         }                                                   \
-        if (AS_CPPSTRING(co->constants[i]) == value) {      \
-            return 1;                                       \
+        if (converter(co->constants[i]) == value) {         \
+            return i;                                       \
         }                                                   \
     }                                                       \
-    co->addConst(ALLOC_STRING(value));           \
+    co->addConst(allocator(value));                         \
 } while (false)
 
 // Generic binary operator
@@ -50,14 +51,14 @@ do {                        \
 } while (false)
 
 #define FUNCTION_CALL(exp)                          \
-do (                                                \
+do {                                                \
     gen(exp.list[0]);                               \
-    for (auto i = 0; i < exp.list.size(); i++) {    \
+    for (auto i = 1; i < exp.list.size(); i++) {    \
         gen(exp.list[i]);                           \
     }                                               \
     emit(OP_CALL);                                  \
     emit(exp.list.size() - 1);                      \
-) while (false)
+} while (false)
 
 // -----------------------------------------------------------------
 
@@ -66,22 +67,38 @@ do (                                                \
  */
 class EvaCompiler {
  public:
-  EvaCompiler(std::shared_ptr<Global> global)
+  EvaCompiler(std::shared_ptr<Global> global, std::ostream& traceOut = std::cout)
       : global(global),
-        disassembler(std::make_unique<EvaDisassembler>(global)) {}
+        disassembler(std::make_unique<EvaDisassembler>(global, traceOut)) {}
 
   /**
    * Main compile API.
    */
   void compile(const Exp& exp) {
+      // Code objects of the previous program are owned by its main
+      // function, and are reclaimed by GC once it's unreachable
+      codeObjects_.clear();
+      immediateCalls_.clear();
+      line_ = 0;
+      // State left by a compile aborted with an error
+      scopeInfo_.clear();
+      scopeStack_ = {};
+      enclosingCos_.clear();
+      classObject_ = nullptr;
+      // Compile errors report the line of the expression
+      ErrorContext errorContext([this]() { return "    at line " + std::to_string(line_); });
       // Allocate new code object
       co = AS_CODE(createCodeObjectValue("main"));
       main = AS_FUNCTION(ALLOC_FUNCTION(co));
-      constantObjects_.insert((Traceable*)main);
+      // Inline calls to small functions
+      auto program = &exp;
+      if (inliner_.analyze(exp)) {
+          program = inliner_.transform(exp);
+      }
       // Scope analysis
-      analyze(exp, nullptr);
+      analyze(*program, nullptr);
       // Generate recursively from top level
-      gen(exp);
+      gen(*program);
       // Explicit VM-stop marker
       emit(OP_HALT);
   }
@@ -90,89 +107,111 @@ class EvaCompiler {
    * Scope analysis.
    */
   void analyze(const Exp& exp, std::shared_ptr<Scope> scope) {
-      switch (exp.type) {
-          if (exp.type == ExpType::Symbol) {
-              if (exp.string == "true" || exp.string == "false" || exp.string == "null") {
-                  // Do nothing
-              }
-              else {
-                  // Variables
-                  scope->maybePromote(exp.string);
-              }
+      if (exp.type == ExpType::SYMBOL) {
+          if (exp.string == "true" || exp.string == "false" || exp.string == "null") {
+              // Do nothing
+          }
+          else {
+              // Variables
+              scope->maybePromote(exp.string);
           }
-          // Lists
-          else if (exp.type == ExpType::LIST) {
-              auto tag = exp.list[0];
-              // Special cases
-              if (tag.type == ExpType::SYMBOL) {
-                  auto op = tag.string;
-                  // Block scope
-                  if (op == "begin") {
-                      auto newScope = std::make_error_code_shared<Scope>(
-                          scope == nullptr ? ScopeType::GLOBAL : ScopeType::BLOCK, scope);
-                      scopeInfo_[&exp] = newScope;
-                      for (auto i = 1; i < exp.list.size(); ++i) {
-                          analyze(exp.list[i], newScope);
+      }
+      // Lists
+      else if (exp.type == ExpType::LIST) {
+          const auto& tag = exp.list[0];
+          // Special cases
+          if (tag.type == ExpType::SYMBOL) {
+              auto op = tag.string;
+              // Block scope
+              if (op == "begin") {
+                  auto newScope = std::make_shared<Scope>(
+                      scope == nullptr ? ScopeType::GLOBAL : ScopeType::BLOCK, scope);
+                  scopeInfo_[&exp] = newScope;
+                  // Globals already in the VM: natives, previous programs,
+                  // and the restored heap snapshot
+                  if (scope == nullptr) {
+                      for (const auto& var : global->globals) {
+                          newScope->addLocal(var.name);
                       }
                   }
-                  // Variable declaration
-                  else if (op == "var") {
-                      scope->addLocal(exp.list[1].string);
-                      analyze(exp.list[2], scope);
-                  }
-                  // Function declaration
-                  else if (op == "def") {
-                      auto fnName = exp.list[1].string;
-                      scope->addLocal(fnName);
-                      auto newScope = std::make_shared<Scope>(ScopeType::FUNCTION, scope);
-                      scopeInfo_[&exp] = newScope;
-                      newScope->addLocal(fnName);
-                      auto arity = exp.list[2].list.size();
-                      // Params
-                      for (auto i = 0; i < arity; i++) {
-                          newScope->addLocal(exp.list[2].list[i].string);
-                      }
-                      // Body
-                      analyze(exp.list[3], newScope);
+                  for (auto i = 1; i < exp.list.size(); ++i) {
+                      analyze(exp.list[i], newScope);
                   }
-                  else if (op == "lambda") {
-                      auto newScope = std::make_shared<Scope>(ScopeType::FUNCTION, scope);
-                      scopeInfo_[&exp] = newScope;
-                      auto arity = exp.list[2].list.size();
-                      // Params
-                      for (auto i = 0; i < arity; i++) {
-                          newScope->addLocal(exp.list[1].list[i].string);
-                      }
-                      // Body
-                      analyze(exp.list[2], newScope);
+              }
+              // Variable declaration
+              else if (op == "var") {
+                  scope->addLocal(exp.list[1].string);
+                  analyze(exp.list[2], scope);
+              }
+              // Function declaration (async functions run in a fiber)
+              else if (op == "def" || op == "async") {
+                  auto fnName = exp.list[1].string;
+                  scope->addLocal(fnName);
+                  auto newScope = std::make_shared<Scope>(ScopeType::FUNCTION, scope);
+                  scopeInfo_[&exp] = newScope;
+                  newScope->addLocal(fnName);
+                  auto arity = exp.list[2].list.size();
+                  // Params
+                  for (auto i = 0; i < arity; i++) {
+                      newScope->addLocal(exp.list[2].list[i].string);
                   }
-                  else if (op == "class") {
-                      auto className = exp.list[1].string;
-                      auto newScope = std::make_shared<Scope>(ScopeType::CLASS, scope);
-                      scopeInfo_[&exp] = newScope;
-                      scope->addLocal(className);
-                      // Class body
-                      for (auto i = 3; i < exp.list.size(); i++) {
-                          analyze(exp.list[i], newScope);
-                      }
+                  // Body
+                  analyze(exp.list[3], newScope);
+              }
+              else if (op == "lambda") {
+                  auto newScope = std::make_shared<Scope>(ScopeType::FUNCTION, scope);
+                  scopeInfo_[&exp] = newScope;
+                  // Immediately invoked lambdas can't outlive the current frame
+                  newScope->escapes = immediateCalls_.count(&exp) == 0;
+                  auto arity = exp.list[1].list.size();
+                  // Params
+                  for (auto i = 0; i < arity; i++) {
+                      newScope->addLocal(exp.list[1].list[i].string);
                   }
-                  // Property access
-                  else if (op == "prop") {
-                      // Don't touch property names as identifiers
-                      analyze(exp.list[1], scope);
+                  // Body
+                  analyze(exp.list[2], newScope);
+              }
+              else if (op == "class") {
+                  auto className = exp.list[1].string;
+                  auto newScope = std::make_shared<Scope>(ScopeType::CLASS, scope);
+                  scopeInfo_[&exp] = newScope;
+                  scope->addLocal(className);
+                  // Class body
+                  for (auto i = 3; i < exp.list.size(); i++) {
+                      analyze(exp.list[i], newScope);
                   }
-                  else {
-                      for (auto i = 1; i < exp.list.size(); i++) {
-                          analyze(exp.list[i], scope);
-                      }
+              }
+              // Spawned call: the callee runs on the fiber stack, so
+              // a lambda there is not an immediate call
+              else if (op == "spawn") {
+                  for (auto i = 0; i < exp.list[1].list.size(); i++) {
+                      analyze(exp.list[1].list[i], scope);
                   }
               }
+              // Property access
+              else if (op == "prop") {
+                  // Don't touch property names as identifiers
+                  analyze(exp.list[1], scope);
+              }
               else {
-                  for (auto i = 0; i < exp.list.size(); ++i) {
+                  // Callee of a named call (special forms are never declared)
+                  if (scope->isDeclared(op)) {
+                      analyze(tag, scope);
+                  }
+                  for (auto i = 1; i < exp.list.size(); i++) {
                       analyze(exp.list[i], scope);
                   }
               }
           }
+          else {
+              // Inline lambda call: ((lambda (x) ...) 2)
+              if (isLambda(tag)) {
+                  immediateCalls_.insert(&exp.list[0]);
+              }
+              for (auto i = 0; i < exp.list.size(); ++i) {
+                  analyze(exp.list[i], scope);
+              }
+          }
       }
   }
 
@@ -180,6 +219,12 @@ class EvaCompiler {
    * Main compile loop.
    */
   void gen(const Exp& exp) {
+    // Code is emitted at the line of the expression (synthesized
+    // nodes keep the line of the enclosing one)
+    auto prevLine = line_;
+    if (exp.line != 0) {
+        line_ = exp.line;
+    }
     switch (exp.type) {
       /**
        * ----------------------------------------------
@@ -187,7 +232,7 @@ class EvaCompiler {
        */
       case ExpType::NUMBER:
           emit(OP_CONST);
-          emit(numbericConstIdx(exp.number));
+          emit(numericConstIdx(exp.number));
         break;
 
       /**
@@ -196,7 +241,7 @@ class EvaCompiler {
        */
       case ExpType::STRING:
           emit(OP_CONST);
-          emit(numbericConstIdx(exp.string));
+          emit(stringConstIdx(exp.string));
         break;
 
       /**
@@ -217,19 +262,23 @@ class EvaCompiler {
           emit(opCodeGetter);
           // 1. Local vars
           if (opCodeGetter == OP_GET_LOCAL) {
-              emit(co->getLocalIndex(varName);
+              emit(co->getLocalIndex(varName));
           } 
-          // 2. Global vars
+          // 2. Cell vars
           else if (opCodeGetter == OP_GET_CELL) {
-              emit(co->getCellIndex(varName);
+              emit(co->getCellIndex(varName));
 
           }
-          // 3. Global vars
+          // 3. Locals of enclosing frames
+          else if (opCodeGetter == OP_GET_PARENT_LOCAL) {
+              emitParentLocal(varName);
+          }
+          // 4. Global vars
           else {
               if (!global->exists(varName)) {
                   DIE << "[EvaCompiler]: Reference error: " << varName;
               }
-              emit(global->getGlobalIndex(varName));
+              emitGlobalIndex(global->getGlobalIndex(varName));
           }
         }
         break;
@@ -239,7 +288,7 @@ class EvaCompiler {
        * Lists.
        */
       case ExpType::LIST:
-        auto tag = exp.list[0];
+        const auto& tag = exp.list[0];
 
         /**
          * ----------------------------------------------
@@ -264,7 +313,7 @@ class EvaCompiler {
               gen(exp.list[1]);
               gen(exp.list[2]);
               emit(OP_COMPARE);
-              emit(compareOps_[op]);
+              emit(compareOps_.at(op));
           }
           /*
           * (if <test> <consequent> <alternate>)
@@ -279,7 +328,7 @@ class EvaCompiler {
               emit(0);
               emit(0);
 
-              auto endAddr = getOffset() - 2;
+              auto elseJmpAddr = getOffset() - 2;
 
               // Emit <consequent>
               gen(exp.list[2]);
@@ -314,16 +363,19 @@ class EvaCompiler {
               emit(0);
               emit(0);
               auto loopEndJmpAddr = getOffset() - 2;
-              // Emit <body>
+              // Emit <body>, its value is not kept between the iterations
               gen(exp.list[2]);
+              emit(OP_POP);
               // Goto loop start
               emit(OP_JMP);
               emit(0);
               emit(0);
               patchJumpAddress(getOffset() - 2, loopStartAddr);
               // Patch the end
-              auto loopEndAddr = getOffset() + 1;
-              patchJumpAddress(loopEndJmpAddr, loopEndAddr);
+              patchJumpAddress(loopEndJmpAddr, getOffset());
+              // The loop evaluates to false (the failed condition)
+              emit(OP_CONST);
+              emit(booleanConstIdx(false));
           }
           else if (op == "var") {
               auto varName = exp.list[1].string;
@@ -344,12 +396,13 @@ class EvaCompiler {
               if (opCodeSetter == OP_SET_GLOBAL){
                   global->define(varName);
                   emit(OP_SET_GLOBAL);
-                  emit(global->getGlobalIndex(varName));
+                  emitGlobalIndex(global->getGlobalIndex(varName));
               }
               // 2. Cells
               else if (opCodeSetter == OP_SET_CELL) {
                   co->cellNames.push_back(varName);
                   emit(OP_SET_CELL);
+                  emit(co->getCellIndex(varName));
                   // Explicitly pop the value from the stack, since it's promoted to the heap
                   emit(OP_POP);
               }
@@ -368,6 +421,15 @@ class EvaCompiler {
                   // Property name
                   emit(OP_SET_PROP);
                   emit(stringConstIdx(exp.list[1].list[2].string));
+              }
+              // Array element writes
+              else if (isIndex(exp.list[1])) {
+                  // Value
+                  gen(exp.list[2]);
+                  // Array and index
+                  gen(exp.list[1].list[1]);
+                  gen(exp.list[1].list[2]);
+                  emit(OP_INDEX_SET);
               } else {
                   auto varName = exp.list[1].string;
 
@@ -385,14 +447,18 @@ class EvaCompiler {
                       emit(OP_SET_CELL);
                       emit(co->getCellIndex(varName));
                   }
+                  else if (opCoderSetter == OP_SET_PARENT_LOCAL) {
+                      emit(OP_SET_PARENT_LOCAL);
+                      emitParentLocal(varName);
+                  }
                   // 2. Global vars
                   else {
                       auto globalIndex = global->getGlobalIndex(varName);
                       if (globalIndex == -1) {
-                          DIE << "Reference error: " << varName << " is not defined."
+                          DIE << "Reference error: " << varName << " is not defined.";
                       }
                       emit(OP_SET_GLOBAL);
-                      emit(globalIndex);
+                      emitGlobalIndex(globalIndex);
                   }
               }
           }
@@ -404,8 +470,10 @@ class EvaCompiler {
               for (auto i = 1; i < exp.list.size(); i++) {
                   // The value of last expression is kept on the stack as the final result
                   bool isLast = i == exp.list.size() - 1;
-                  // Local variable or function (should not pop)
-                  auto isDecl = isDeclaration(exp.list[i]);
+                  // Local variable or function (should not pop), global ones are
+                  // stored in the globals and popped (classes leave no value)
+                  auto isDecl = isDeclaration(exp.list[i]) &&
+                                (!isGlobalScope() || isClassDeclaration(exp.list[i]));
                   // Generate expression code
                   gen(exp.list[i]);
                   if (!isLast && !isDecl) {
@@ -415,14 +483,15 @@ class EvaCompiler {
               blockExit();
               scopeStack_.pop();
           }
-          else if (op == "def") {
+          else if (op == "def" || op == "async") {
               auto fnName = exp.list[1].string;
 
               compileFunction(
                   /* exp */ exp,
                   /* name */ fnName,
                   /* params */ exp.list[2],
-                  /* body */ exp.list[3]);
+                  /* body */ exp.list[3],
+                  /* isAsync */ op == "async");
 
               // Define the function as a variable in our co
 
@@ -431,7 +500,7 @@ class EvaCompiler {
                   if (isGlobalScope()) {
                       global->define(fnName);
                       emit(OP_SET_GLOBAL);
-                      emit(global->getGlobalIndex(fnName));
+                      emitGlobalIndex(global->getGlobalIndex(fnName));
                   }
                   else {
                       co->addLocal(fnName);
@@ -454,13 +523,10 @@ class EvaCompiler {
                   : getClassByName(exp.list[2].string);
               auto cls = ALLOC_CLASS(name, superClass);
               auto classObject = AS_CLASS(cls);
-              classObjects_.push_back(classObject);
-              // Track for GC
-              constantObjects_.insert((Traceable*)classObject);
-              // Put the class in constant pool
+              // Put the class in constant pool (traced by GC from the code object)
               co->addConst(cls);
               // Register set as global
-              global->define(name, cls);
+              global->define(name);
               //And pre-install to the global
               global->set(global->getGlobalIndex(name), cls);
               // To compile class body we set the current compiling class, so the defined methods are stored
@@ -490,7 +556,7 @@ class EvaCompiler {
               }
               // Load class
               emit(OP_GET_GLOBAL);
-              emit(global->getGlobalIndex(className));
+              emitGlobalIndex(global->getGlobalIndex(className));
               // New instance
               emit(OP_NEW);
               // NOTE: After the OP_NEW, the constructor function and the created instance are on top of the stack
@@ -502,6 +568,84 @@ class EvaCompiler {
               emit(OP_CALL);
               emit(AS_FUNCTION(cls->getProp("constructor"))->co->arity);
           }
+          // (array <element>...)
+          else if (op == "array") {
+              auto count = exp.list.size() - 1;
+              if (count > 255) {
+                  DIE << "[EvaCompiler]: Array literal is too long (" << count
+                      << " elements), use push";
+              }
+              for (auto i = 1; i < exp.list.size(); i++) {
+                  gen(exp.list[i]);
+              }
+              emit(OP_ARRAY_NEW);
+              emit(count);
+          }
+          // (index <array> <index>)
+          else if (op == "index") {
+              gen(exp.list[1]);
+              gen(exp.list[2]);
+              emit(OP_INDEX_GET);
+          }
+          // (map <key> <value>...)
+          else if (op == "map") {
+              auto count = (exp.list.size() - 1) / 2;
+              if (exp.list.size() % 2 == 0) {
+                  DIE << "[EvaCompiler]: Map literal expects key/value pairs";
+              }
+              if (count > 255) {
+                  DIE << "[EvaCompiler]: Map literal is too long (" << count
+                      << " entries), use set";
+              }
+              for (auto i = 1; i < exp.list.size(); i++) {
+                  gen(exp.list[i]);
+              }
+              emit(OP_MAP_NEW);
+              emit(count);
+          }
+          // (has <map> <key>), (delete <map> <key>)
+          else if (op == "has") {
+              GEN_BINARY_OP(OP_MAP_HAS);
+          }
+          else if (op == "delete") {
+              GEN_BINARY_OP(OP_MAP_DELETE);
+          }
+          // Iteration: (map-next <map> <cursor>), (map-key <map> <cursor>), ...
+          else if (op == "map-next") {
+              GEN_BINARY_OP(OP_MAP_NEXT);
+          }
+          else if (op == "map-key") {
+              GEN_BINARY_OP(OP_MAP_KEY);
+          }
+          else if (op == "map-value") {
+              GEN_BINARY_OP(OP_MAP_VALUE);
+          }
+          // (spawn (<fn> <arg>...)): the call runs in a new fiber
+          else if (op == "spawn") {
+              const auto& call = exp.list[1];
+              if (call.type != ExpType::LIST || call.list.size() == 0) {
+                  DIE << "[EvaCompiler]: spawn expects a function call";
+              }
+              for (auto i = 0; i < call.list.size(); i++) {
+                  gen(call.list[i]);
+              }
+              emit(OP_SPAWN);
+              emit(call.list.size() - 1);
+          }
+          // (await <fiber>)
+          else if (op == "await") {
+              gen(exp.list[1]);
+              emit(OP_AWAIT);
+          }
+          // (yield)
+          else if (op == "yield") {
+              emit(OP_YIELD);
+          }
+          // (len <array, map or string>)
+          else if (op == "len") {
+              gen(exp.list[1]);
+              emit(OP_LEN);
+          }
           else if (op == "prop") {
               // Instance
               gen(exp.list[1]);
@@ -509,23 +653,24 @@ class EvaCompiler {
               emit(OP_GET_PROP);
               emit(stringConstIdx(exp.list[2].string));
           }
-          else {
-              // Named function calls
-              FUNCTION_CALL(exp);
-          }
-        }
-        else if (op == "super") {
+          else if (op == "super") {
             auto className = exp.list[1].string;
             auto cls = getClassByName(className);
             if (cls == nullptr) {
-                DIE << "[EvaCompiler]: Unknown class " << cls;
+                DIE << "[EvaCompiler]: Unknown class " << className;
             }
             if (cls->superClass == nullptr) {
-                DIE << "[EvaCompiler]: Class " << cls->name;
+                DIE << "[EvaCompiler]: Class " << cls->name
                     << " doesn't have super class";
             }
             emit(OP_GET_GLOBAL);
-            emit(global->getGlobalIndex(cls->superClass->name));
+            emitGlobalIndex(global->getGlobalIndex(cls->superClass->name));
+          }
+          else {
+              // Named function calls
+              checkNativeArity(exp);
+              FUNCTION_CALL(exp);
+          }
         }
 
         // --------------------------------------------
@@ -538,6 +683,7 @@ class EvaCompiler {
         }
         break;
     }
+    line_ = prevLine;
   }
 
   /**
@@ -555,9 +701,12 @@ class EvaCompiler {
   FunctionObject* getMainFunction() { return main; }
 
   /**
-   * Returns all constant traceable objects.
+   * Sets main function of a program loaded from the bytecode cache.
    */
-  std::set<Traceable*>& getConstantObjects() { return constantObjects_; }
+  void setMainFunction(FunctionObject* fn) {
+      codeObjects_.clear();
+      main = fn;
+  }
 
  private:
   /**
@@ -581,7 +730,7 @@ class EvaCompiler {
   void scopeExit() { 
       // Pop vars from the stack if they were declared within this specific scope.
       auto varsCount = getVarsCountOnScopeExit();
-      if (varsCount > 0 || co->arity > 0) {
+      if (varsCount > 0 || isFunctionBody()) {
           emit(OP_SCOPE_EXIT);
           // For functions do callee cleanup: pop all arguments plus the function name
           if (isFunctionBody()) {
@@ -596,23 +745,25 @@ class EvaCompiler {
    * Compiles a function.
    */
   void compileFunction(const Exp& exp, const std::string fnName,
-                       const Exp& params, const Exp& body) {
+                       const Exp& params, const Exp& body, bool isAsync = false) {
       auto scopeInfo = scopeInfo_.at(&exp);
       scopeStack_.push(scopeInfo);
       auto arity = params.list.size();
       // Save previous code object
       auto prevCo = co;
+      enclosingCos_.push_back(prevCo);
       // Function code object
       auto coValue = createCodeObjectValue(
           classObject_ != nullptr ? (classObject_->name + "." + fnName) : fnName, arity);
       co = AS_CODE(coValue);
+      co->isAsync = isAsync;
       // Put 'free' and 'cells' from the scope into the cellNames of the code object
       co->freeCount = scopeInfo->free.size();
       co->cellNames.reserve(scopeInfo->free.size() + scopeInfo->cells.size());
       co->cellNames.insert(co->cellNames.end(), scopeInfo->free.begin(), scopeInfo->free.end());
       co->cellNames.insert(co->cellNames.end(), scopeInfo->cells.begin(), scopeInfo->cells.end());
       // Store new co as a constant
-      prevCo->constants(coValue);
+      prevCo->constants.push_back(coValue);
       // Function name is registered as a local, so the function can call itself recursively.
       co->addLocal(fnName);
       // Parameters are added as variables
@@ -630,7 +781,15 @@ class EvaCompiler {
       // Compile body in the new code object
       auto prevClassObject = classObject_;
       classObject_ = nullptr;
+      // Blocks nested in a non-block body are not the function body
+      // (they don't do the callee cleanup)
+      if (!isBlock(body)) {
+          co->scopeLevel++;
+      }
       gen(body);
+      if (!isBlock(body)) {
+          co->scopeLevel--;
+      }
       classObject_ = prevClassObject;
       // If we don't have explicit block which pops locals, we should pop arguments (if any) - callee cleanup
       // + 1 is for the function itself which is set as a local
@@ -644,7 +803,6 @@ class EvaCompiler {
       if (classObject_ != nullptr) {
           // Create the function
           auto fn = ALLOC_FUNCTION(co);
-          constantObjects_.insert((Traceable*)AS_OBJECT(fn));
           // Restore the code object
           co = prevCo;
           // Add method to the class
@@ -656,7 +814,6 @@ class EvaCompiler {
       else if (scopeInfo->free.size() == 0) {
           // Create the function
           auto fn = ALLOC_FUNCTION(co);
-          constantObjects_.insert((Traceable*)AS_OBJECT(fn));
           // Restore the code object
           co = prevCo;
           // Add function as a constant to our co
@@ -684,17 +841,29 @@ class EvaCompiler {
           // How many cells to capture
           emit(scopeInfo->free.size());
       }
+      enclosingCos_.pop_back();
       scopeStack_.pop();
   }
 
+  /**
+   * Emits frame link operands of a local in an enclosing
+   * function: <depth> <index>.
+   */
+  void emitParentLocal(const std::string& varName) {
+      auto depth = scopeStack_.top()->linkDepth.at(varName);
+      auto ownerCo = enclosingCos_[enclosingCos_.size() - depth];
+      emit(depth);
+      emit(ownerCo->getLocalIndex(varName));
+  }
+
   /**
    * Creates a new code object.
    */
   EvaValue createCodeObjectValue(const std::string& name, size_t arity = 0) {
       auto coValue = ALLOC_CODE(name, arity);
-      auto co = AS_CODE(codeValue);
+      auto co = AS_CODE(coValue);
+      co->startLines(line_);
       codeObjects_.push_back(co);
-      constantObjects_.insert((Traceable*)co);
       return coValue;
   }
 
@@ -709,7 +878,7 @@ class EvaCompiler {
   void blockExit() {
       // Pop vars from the stack if they were declared within this specific scope
       auto varsCount = getVarsCountOnScopeExit();
-      if (varsCount > 0 || co->arity > 0) {
+      if (varsCount > 0 || isFunctionBody()) {
           emit(OP_SCOPE_EXIT);
           // For functions do callee cleanup: pop all arguments plus the function name
           if (isFunctionBody()) {
@@ -748,6 +917,11 @@ class EvaCompiler {
    */
   bool isProp(const Exp& exp) { return isTaggedList(exp, "prop"); }
 
+  /**
+   * Whether the expression is an array element.
+   */
+  bool isIndex(const Exp& exp) { return isTaggedList(exp, "index"); }
+
   /**
    * (var <name> <value>)
    */
@@ -759,10 +933,10 @@ class EvaCompiler {
   bool isLambda(const Exp& exp) { return isTaggedList(exp, "lambda"); }
 
   /**
-   * (def <name> ...)
+   * (def <name> ...), (async <name> ...)
    */
   bool isFunctionDeclaration(const Exp& exp) {
-    return isTaggedList(exp, "def");
+    return isTaggedList(exp, "def") || isTaggedList(exp, "async");
   }
 
   /**
@@ -785,7 +959,7 @@ class EvaCompiler {
   size_t getVarsCountOnScopeExit() {
       auto varsCount = 0;
       if (co->locals.size() > 0) {
-          while (co->locals.back().scopeLevel == co->scopeLevel) {
+          while (co->locals.size() > 0 && co->locals.back().scopeLevel == co->scopeLevel) {
               co->locals.pop_back();
               varsCount++;
           }
@@ -793,6 +967,26 @@ class EvaCompiler {
       return varsCount;
   }
 
+  /**
+   * Checks arity of a direct call to a native function at link time.
+   */
+  void checkNativeArity(const Exp& exp) {
+      auto& name = exp.list[0].string;
+      auto globalIndex = global->getGlobalIndex(name);
+      if (globalIndex == -1 || !IS_NATIVE(global->get(globalIndex).value)) {
+          return;
+      }
+      // Shadowed by a local or a cell
+      if (scopeStack_.top()->getNameGetter(name) != OP_GET_GLOBAL) {
+          return;
+      }
+      auto native = AS_NATIVE(global->get(globalIndex).value);
+      if (exp.list.size() - 1 != native->arity) {
+          DIE << "[EvaCompiler]: Native " << name << " expects " << native->arity
+              << " arguments, got " << exp.list.size() - 1;
+      }
+  }
+
   /**
    * Returns current bytecode offset.
    */
@@ -811,7 +1005,6 @@ class EvaCompiler {
    */
   size_t stringConstIdx(const std::string& value) {
       ALLOC_CONST(IS_STRING, AS_CPPSTRING, ALLOC_STRING, value);
-      constantObjects_.insert((Traceable*)co->constants.back().object);
       return co->constants.size() - 1;
   }
 
@@ -824,9 +1017,26 @@ class EvaCompiler {
   }
 
   /**
-   * Emits data to the bytecode.
+   * Emits a 2-byte global index.
    */
-  void emit(uint8_t code) { co->code.push_back(code); }
+  void emitGlobalIndex(int index) {
+      if (index < 0 || index >= GLOBALS_LIMIT) {
+          DIE << "[EvaCompiler]: Invalid global index " << index;
+      }
+      emit((index >> 8) & 0xff);
+      emit(index & 0xff);
+  }
+
+  /**
+   * Emits data to the bytecode, and starts a line table
+   * run if the line changed.
+   */
+  void emit(uint8_t code) {
+      if (line_ != co->lastLine && line_ != 0) {
+          co->addLine(co->code.size(), line_);
+      }
+      co->code.push_back(code);
+  }
 
   /**
    * Writes byte at offset.
@@ -845,14 +1055,20 @@ class EvaCompiler {
 
   /**
    * Returns a class object by name.
+   *
+   * Classes are resolved through the globals they're installed
+   * to, so the compiler doesn't pin them for the GC.
    */
   ClassObject* getClassByName(const std::string& name) {
-      for (const auto& classObject : classObjects_) {
-          if (classObject->name == name) {
-              return classObject;
-          }
+      auto globalIndex = global->getGlobalIndex(name);
+      if (globalIndex == -1) {
+          return nullptr;
+      }
+      auto value = global->get(globalIndex).value;
+      if (!IS_CLASS(value)) {
+          return nullptr;
       }
-      return nullptr;
+      return AS_CLASS(value);
   }
 
   /**
@@ -860,6 +1076,21 @@ class EvaCompiler {
    */
   std::map<const Exp*, std::shared_ptr<Scope>> scopeInfo_;
 
+  /**
+   * Function inliner.
+   */
+  Inliner inliner_;
+
+  /**
+   * Immediately invoked lambdas (non-escaping functions).
+   */
+  std::set<const Exp*> immediateCalls_;
+
+  /**
+   * Code objects of the enclosing functions being compiled.
+   */
+  std::vector<CodeObject*> enclosingCos_;
+
   /**
    * Scopes stack.
    */
@@ -880,31 +1111,26 @@ class EvaCompiler {
    */
   std::vector<CodeObject*> codeObjects_;
 
-  /**
-   * All objects from the constant pools of all code objects.
-   */
-  std::set<Traceable*> constantObjects_;
-
   /**
    * Currently compiling class object.
    */
-  ClassObject* classObject_;
+  ClassObject* classObject_ = nullptr;
 
   /**
-   * All class objects.
+   * Source line of the expression being compiled.
    */
-  std::vector<ClassObject*> classObjects_;
+  uint32_t line_ = 0;
 
   /**
    * Compare ops map.
    */
-  static std::map<std::string, uint8_t> compareOps_;
+  static const std::map<std::string, uint8_t> compareOps_;
 };
 
 /**
  * Compare ops map.
  */
-std::map<std::string, uint8_t> EvaCompiler::compareOps_ = {
+const std::map<std::string, uint8_t> EvaCompiler::compareOps_ = {
     {"<", 0}, {">", 1}, {"==", 2}, {">=", 3}, {"<=", 4}, {"!=", 5},
 };
 
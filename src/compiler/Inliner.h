@@ -0,0 +1,273 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Function inliner.
+ */
+
+#ifndef Inliner_h
+#define Inliner_h
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "../parser/Exp.h"
+
+/**
+ * Max number of AST nodes in an inlined function body.
+ */
+#define INLINE_BUDGET 24
+
+/**
+ * Inliner: substitutes calls to small global functions
+ * with their bodies.
+ *
+ * A function is inlined if it's a top-level (def ...) whose name
+ * is never redeclared or reassigned, and whose body fits into the
+ * budget and only uses its parameters, literals, math, comparison
+ * and `if` (hence it's neither recursive, nor a closure).
+ *
+ * Calls whose arguments are all literals or variables are inlined,
+ * the arguments are substituted directly (the body has no side
+ * effects, so a variable reads the same value at each use):
+ *
+ *   (square a)  ->  (* a a)
+ *
+ * Other calls are kept: a block local for the argument would be
+ * placed in the expression position, above the operands already
+ * on the stack, which the local slots don't account for.
+ */
+class Inliner {
+ public:
+  /**
+   * Whether the program has functions to inline.
+   */
+  bool analyze(const Exp& program) {
+      candidates_.clear();
+      arena_.reset();
+      if (!isTaggedList(program, "begin")) {
+          return false;
+      }
+      // Top-level function candidates
+      for (auto i = 1; i < program.list.size(); i++) {
+          auto& exp = program.list[i];
+          if (isTaggedList(exp, "def") && isInlinable(exp)) {
+              candidates_[exp.list[1].string] = &exp;
+          }
+      }
+      if (candidates_.empty()) {
+          return false;
+      }
+      // Drop the functions which are redeclared or reassigned anywhere
+      std::map<std::string, size_t> declarations;
+      countDeclarations(program, declarations);
+      for (auto it = candidates_.begin(); it != candidates_.end();) {
+          if (declarations[it->first] != 1) {
+              it = candidates_.erase(it);
+          } else {
+              ++it;
+          }
+      }
+      return !candidates_.empty();
+  }
+
+  /**
+   * Returns the program with the calls inlined. Unchanged
+   * subtrees are shared with the original program.
+   */
+  const Exp* transform(const Exp& exp, bool inlineCall = true) {
+      if (exp.type != ExpType::LIST || exp.list.empty()) {
+          return &exp;
+      }
+      std::vector<const Exp*> list;
+      list.reserve(exp.list.size());
+      auto changed = false;
+      // A spawned call runs in its own fiber, only its arguments are inlined
+      auto isSpawn = isTaggedList(exp, "spawn");
+      for (const auto& child : exp.list) {
+          list.push_back(transform(child, !isSpawn));
+          changed = changed || list.back() != &child;
+      }
+      auto& tag = exp.list[0];
+      if (inlineCall && tag.type == ExpType::SYMBOL &&
+          candidates_.count(tag.string) != 0) {
+          auto fn = candidates_[tag.string];
+          if (fn->list[2].list.size() == list.size() - 1 && hasPlainArgs(list)) {
+              return expand(*fn, list);
+          }
+      }
+      if (!changed) {
+          return &exp;
+      }
+      auto copy = arena_.list(list);
+      copy->line = exp.line;
+      return copy;
+  }
+
+ private:
+  /**
+   * Whether the call arguments are literals or variables.
+   */
+  bool hasPlainArgs(const std::vector<const Exp*>& call) {
+      for (auto i = 1; i < call.size(); i++) {
+          if (call[i]->type == ExpType::LIST) {
+              return false;
+          }
+      }
+      return true;
+  }
+
+  /**
+   * Expands the function body for the (already transformed) call.
+   */
+  const Exp* expand(const Exp& fn, const std::vector<const Exp*>& call) {
+      auto& params = fn.list[2].list;
+      std::map<std::string, const Exp*> bindings;
+      for (auto i = 0; i < params.size(); i++) {
+          bindings[params[i].string] = call[i + 1];
+      }
+      return substitute(fn.list[3], bindings);
+  }
+
+  /**
+   * Replaces parameters in the body.
+   */
+  const Exp* substitute(const Exp& exp,
+                        const std::map<std::string, const Exp*>& bindings) {
+      if (exp.type == ExpType::SYMBOL) {
+          auto it = bindings.find(exp.string);
+          return it != bindings.end() ? it->second : &exp;
+      }
+      if (exp.type != ExpType::LIST) {
+          return &exp;
+      }
+      std::vector<const Exp*> list{&exp.list[0]};
+      for (auto i = 1; i < exp.list.size(); i++) {
+          list.push_back(substitute(exp.list[i], bindings));
+      }
+      auto copy = arena_.list(list);
+      copy->line = exp.line;
+      return copy;
+  }
+
+  /**
+   * Whether the function is small and self-contained.
+   */
+  bool isInlinable(const Exp& fn) {
+      if (fn.list.size() != 4 || fn.list[1].type != ExpType::SYMBOL ||
+          fn.list[2].type != ExpType::LIST) {
+          return false;
+      }
+      std::set<std::string> params;
+      for (const auto& param : fn.list[2].list) {
+          if (param.type != ExpType::SYMBOL) {
+              return false;
+          }
+          params.insert(param.string);
+      }
+      size_t size = 0;
+      return isSimple(fn.list[3], params, size) && size <= INLINE_BUDGET;
+  }
+
+  /**
+   * Whether the expression only uses params, literals and primitive ops.
+   */
+  bool isSimple(const Exp& exp, const std::set<std::string>& params,
+                size_t& size) {
+      size++;
+      switch (exp.type) {
+          case ExpType::NUMBER:
+          case ExpType::STRING:
+              return true;
+          case ExpType::SYMBOL:
+              return params.count(exp.string) != 0 || exp.string == "true" ||
+                     exp.string == "false";
+          case ExpType::LIST: {
+              if (exp.list.empty() || exp.list[0].type != ExpType::SYMBOL ||
+                  primitiveOps_.count(exp.list[0].string) == 0) {
+                  return false;
+              }
+              for (auto i = 1; i < exp.list.size(); i++) {
+                  if (!isSimple(exp.list[i], params, size)) {
+                      return false;
+                  }
+              }
+              return true;
+          }
+      }
+      return false;
+  }
+
+  /**
+   * Counts declarations and assignments of the names.
+   */
+  void countDeclarations(const Exp& exp,
+                         std::map<std::string, size_t>& declarations) {
+      if (exp.type != ExpType::LIST || exp.list.empty()) {
+          return;
+      }
+      auto& tag = exp.list[0];
+      if (tag.type == ExpType::SYMBOL && exp.list.size() > 1) {
+          auto op = tag.string;
+          if ((op == "def" || op == "async" || op == "var" || op == "set" ||
+               op == "class") &&
+              exp.list[1].type == ExpType::SYMBOL) {
+              declarations[exp.list[1].string]++;
+          }
+          // Parameters
+          auto paramsIndex =
+              op == "def" || op == "async" ? 2 : op == "lambda" ? 1 : 0;
+          if (paramsIndex != 0 && exp.list.size() > paramsIndex &&
+              exp.list[paramsIndex].type == ExpType::LIST) {
+              for (const auto& param : exp.list[paramsIndex].list) {
+                  if (param.type == ExpType::SYMBOL) {
+                      declarations[param.string]++;
+                  }
+              }
+          }
+      }
+      for (const auto& child : exp.list) {
+          countDeclarations(child, declarations);
+      }
+  }
+
+  /**
+   * Whether the expression is a list with the tag.
+   */
+  bool isTaggedList(const Exp& exp, const std::string& tag) {
+      return exp.type == ExpType::LIST && !exp.list.empty() &&
+             exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+  }
+
+  /**
+   * Arena for the rewritten expressions.
+   */
+  ExpArena arena_;
+
+  /**
+   * Functions to inline.
+   */
+  std::map<std::string, const Exp*> candidates_;
+
+  /**
+   * Operations allowed in the inlined bodies.
+   */
+  static const std::set<std::string> primitiveOps_;
+};
+
+/**
+ * Operations allowed in the inlined bodies.
+ */
+const std::set<std::string> Inliner::primitiveOps_ = {
+    "+", "-", "*", "/", "<", ">", "==", ">=", "<=", "!=", "if",
+};
+
+#endif
@@ -17,6 +17,8 @@
 
 #include <map>
 #include <set>
+#include <tuple>
+#include <vector>
 
 /**
  * Scope type.
@@ -35,6 +37,9 @@ enum class AllocType {
   GLOBAL,
   LOCAL,
   CELL,
+  // Local of an enclosing frame, reached through the frame link
+  // from a non-escaping function
+  LINK,
 };
 
 /**
@@ -55,6 +60,7 @@ struct Scope {
    * Registers an own cell.
    */
   void addCell(const std::string& name) {
+      cells.insert(name);
       allocInfo[name] = AllocType::CELL;
   }
 
@@ -66,25 +72,43 @@ struct Scope {
       allocInfo[name] = AllocType::CELL;
   }
 
+  /**
+   * Whether the name is declared in this or an enclosing scope.
+   */
+  bool isDeclared(const std::string& name) {
+      for (auto scope = this; scope != nullptr; scope = scope->parent.get()) {
+          if (scope->allocInfo.count(name) != 0) {
+              return true;
+          }
+      }
+      return false;
+  }
+
   /**
    * Potentially promotes a variable from local to cell.
    */
   void maybePromote(const std::string& name) {
-      auto initAllocType = scopeType == ScopeType::GLOBAL ? AllocType::GLOBAL : AllocType::LOCAL;
+      auto initAllocType = type == ScopeType::GLOBAL ? AllocType::GLOBAL : AllocType::LOCAL;
       if (allocInfo.count(name) != 0) {
           initAllocType = allocInfo[name];
       }
-      // Already promoted
-      if (initAllocType == AllocType::CELL) {
+      // Already promoted or linked
+      if (initAllocType == AllocType::CELL || initAllocType == AllocType::LINK) {
           return;
       }
-      auto [ownerScope, allocType] = resolve(name, initAllocType);
+      auto [ownerScope, allocType, depth] = resolve(name, initAllocType);
       // Update the alloc type based on resolution
       allocInfo[name] = allocType;
       // If we resolve it as a cell, promote to heap
       if (allocType == AllocType::CELL) {
           promote(name, ownerScope);
       }
+      // Otherwise, if it's reached through the frame link, register the use,
+      // so we can fall back to a cell if the owner promotes the variable later
+      else if (allocType == AllocType::LINK) {
+          linkDepth[name] = depth;
+          ownerScope->linkUsers[name].push_back(this);
+      }
   }
 
   /**
@@ -98,6 +122,15 @@ struct Scope {
           scope->addFree(name);
           scope = scope->parent.get();
       }
+      // The variable is on the heap now, so the linked uses capture the cell as well
+      if (ownerScope->linkUsers.count(name) != 0) {
+          auto users = ownerScope->linkUsers[name];
+          ownerScope->linkUsers.erase(name);
+          for (auto& user : users) {
+              user->linkDepth.erase(name);
+              user->promote(name, ownerScope);
+          }
+      }
   }
 
   /**
@@ -106,17 +139,32 @@ struct Scope {
    * Initially a variable is treated as local, however if during
    * the resolution we passed the own function boundary, it is
    * free, and hence should be promoted to a cell, unless global.
+   *
+   * Crossing the boundary of a non-escaping function (which can't
+   * outlive the enclosing frame) keeps the variable on the stack:
+   * it's linked, and `depth` counts the frames to walk up.
    */
-  std::pair<Scope*, AllocType> resolve(const std::string& name,
-                                       AllocType allocType) {
-    // Found in the current scope
-    if (allocInfo.count(name) != 0) {
-        return std::make_pair(this, allocType);
+  std::tuple<Scope*, AllocType, size_t> resolve(const std::string& name,
+                                                AllocType allocType,
+                                                size_t depth = 0) {
+    // Found in the current scope (linked names are owned by an enclosing scope)
+    if (allocInfo.count(name) != 0 && allocInfo[name] != AllocType::LINK) {
+        // The owner already keeps the variable on the heap
+        if (allocType == AllocType::LINK && allocInfo[name] == AllocType::CELL) {
+            allocType = AllocType::CELL;
+        }
+        return std::make_tuple(this, allocType, depth);
     }
     // We crossed the boundary of the function and still didn't
     // resolve a local variable - further resolution should be free
     if (type == ScopeType::FUNCTION) {
-        allocType = AllocType::CELL;
+        if (!escapes && allocType != AllocType::CELL) {
+            allocType = AllocType::LINK;
+            depth++;
+        }
+        else {
+            allocType = AllocType::CELL;
+        }
     }
     if (parent == nullptr) {
         DIE << "[Scope] Reference error: " << name << " is not defined.";
@@ -125,7 +173,7 @@ struct Scope {
     if (parent->type == ScopeType::GLOBAL) {
         allocType = AllocType::GLOBAL;
     }
-    return parent->resolve(name, allocType);
+    return parent->resolve(name, allocType, depth);
   }
 
   /**
@@ -139,6 +187,8 @@ struct Scope {
             return OP_GET_LOCAL;
         case AllocType::CELL:
             return OP_GET_CELL;
+        case AllocType::LINK:
+            return OP_GET_PARENT_LOCAL;
     }
   }
 
@@ -153,6 +203,8 @@ struct Scope {
           return OP_SET_LOCAL;
       case AllocType::CELL:
           return OP_SET_CELL;
+      case AllocType::LINK:
+          return OP_SET_PARENT_LOCAL;
     }
   }
 
@@ -180,6 +232,22 @@ struct Scope {
    * Set of own cells.
    */
   std::set<std::string> cells;
+
+  /**
+   * Whether a function may outlive the enclosing frame. Immediately
+   * invoked lambdas don't escape, and access outer locals by link.
+   */
+  bool escapes = true;
+
+  /**
+   * Frame link depth of the linked variables.
+   */
+  std::map<std::string, size_t> linkDepth;
+
+  /**
+   * Scopes which reach own variables through the frame link.
+   */
+  std::map<std::string, std::vector<Scope*>> linkUsers;
 };
 
 #endif
\ No newline at end of file
@@ -16,8 +16,10 @@
 #define EvaDisassembler_h
 
 #include <array>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <string>
 
 #include "../bytecode/OpCode.h"
@@ -29,17 +31,28 @@
  */
 class EvaDisassembler {
  public:
-  EvaDisassembler(std::shared_ptr<Global> global) : global(global) {}
+  EvaDisassembler(std::shared_ptr<Global> global, std::ostream& out = std::cout)
+      : global(global), out(out) {}
   /**
    * Disassembles a code unit.
    */
-  void disassemble(CodeObject* co) {
-      std::cout << "\n---------- Disassembly: " << co->name
+  void disassemble(CodeObject* co) { disassemble(co, nullptr); }
+
+  /**
+   * Disassembles a code unit, printing the annotation of each
+   * instruction (e.g. profile counters) before it.
+   */
+  void disassemble(CodeObject* co,
+                   const std::function<void(size_t offset)>& annotate) {
+      out << "\n---------- Disassembly: " << co->name
                 << " ----------\n\n";
       size_t offset = 0;
-      while (offset < co->code.size()) {
-          offset = dissassembleInstruction(co, offset);
-          std::cout << "\n";
+      while (offset < co->getCodeSize()) {
+          if (annotate) {
+              annotate(offset);
+          }
+          offset = disassembleInstruction(co, offset);
+          out << "\n";
       }
   }
 
@@ -53,11 +66,11 @@ class EvaDisassembler {
    * Disassembles individual instruction.
    */
   size_t disassembleInstruction(CodeObject* co, size_t offset) {
-      std::ios_base::fmtflags f(std::cout.flags());
+      std::ios_base::fmtflags f(out.flags());
       // Print bytecode offset
-      std::cout << std::uppercase << std::hex << std::setfill('0') << std::right
+      out << std::uppercase << std::hex << std::setfill('0') << std::right
           << std::setw(4) << offset << "     ";
-      auto opcode = co->code[offset];
+      auto opcode = co->getCode()[offset];
       switch (opcode) {
         case OP_HALT:
         case OP_ADD:
@@ -65,11 +78,24 @@ class EvaDisassembler {
         case OP_MUL:
         case OP_DIV:
         case OP_POP:
-        case OP_RETURN;
-        case OP_NEW;
+        case OP_RETURN:
+        case OP_NEW:
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+        case OP_LEN:
+        case OP_MAP_HAS:
+        case OP_MAP_DELETE:
+        case OP_MAP_NEXT:
+        case OP_MAP_KEY:
+        case OP_MAP_VALUE:
+        case OP_AWAIT:
+        case OP_YIELD:
           return disassembleSimple(co, opcode, offset);
         case OP_SCOPE_EXIT:
         case OP_CALL:
+        case OP_ARRAY_NEW:
+        case OP_MAP_NEW:
+        case OP_SPAWN:
           return disassembleWord(co, opcode, offset);
         case OP_CONST:
           return disassembleConst(co, opcode, offset);
@@ -84,6 +110,9 @@ class EvaDisassembler {
         case OP_GET_LOCAL:
         case OP_SET_LOCAL:
             return disassembleLocal(co, opcode, offset);
+        case OP_GET_PARENT_LOCAL:
+        case OP_SET_PARENT_LOCAL:
+            return disassembleParentLocal(co, opcode, offset);
         case OP_GET_CELL:
         case OP_SET_CELL:
         case OP_LOAD_CELL:
@@ -98,7 +127,7 @@ class EvaDisassembler {
                 << opcodeToString(opcode);
       }
 
-      std::cout.flags(f);
+      out.flags(f);
       return 0; // Unreachable
   }
 
@@ -117,7 +146,7 @@ class EvaDisassembler {
   size_t disassembleWord(CodeObject* co, uint8_t opcode, size_t offset) {
       dumpBytes(co, offset, 2);
       printOpCode(opcode);
-      std::cout << (int)co->code[offset + 1];
+      out << (int)co->getCode()[offset + 1];
       return offset + 2;
   }
 
@@ -127,8 +156,8 @@ class EvaDisassembler {
   size_t disassembleConst(CodeObject* co, uint8_t opcode, size_t offset) {
       dumpBytes(co, offset, 2);
       printOpCode(opcode);
-      auto constIndex = co->code[offset + 1];
-      std::cout << (int)constIndex << " ("
+      auto constIndex = co->getCode()[offset + 1];
+      out << (int)constIndex << " ("
           << evaValueToConstantString(co->constants[constIndex]) << ")";
       return offset + 2;
   }
@@ -137,12 +166,12 @@ class EvaDisassembler {
    * Disassembles global variable instruction.
    */
   size_t disassembleGlobal(CodeObject* co, uint8_t opcode, size_t offset) {
-      dumpBytes(co, offset, 2);
+      dumpBytes(co, offset, 3);
       printOpCode(opcode);
-      auto globalIndex = co->code[offset + 1];
-      std::cout << (int)globalIndex << " ("
+      auto globalIndex = readWordAtOffset(co, offset + 1);
+      out << (int)globalIndex << " ("
           << global->get(globalIndex).name << ")";
-      return offset + 2;
+      return offset + 3; // Instruction + 2 bytes index
   }
 
   /**
@@ -151,20 +180,31 @@ class EvaDisassembler {
   size_t disassembleLocal(CodeObject* co, uint8_t opcode, size_t offset) {
       dumpBytes(co, offset, 2);
       printOpCode(opcode);
-      auto localIndex = co->code[offset + 1];
-      std::cout << (int)localIndex << " ("
+      auto localIndex = co->getCode()[offset + 1];
+      out << (int)localIndex << " ("
           << co->locals[localIndex].name << ")";
       return offset + 2;
   }
 
+  /**
+   * Disassembles enclosing frame local: OP_GET_PARENT_LOCAL <depth> <index>
+   */
+  size_t disassembleParentLocal(CodeObject* co, uint8_t opcode, size_t offset) {
+      dumpBytes(co, offset, 3);
+      printOpCode(opcode);
+      out << (int)co->getCode()[offset + 1] << ", "
+          << (int)co->getCode()[offset + 2];
+      return offset + 3;
+  }
+
   /**
    * Disassembles property instruction.
    */
   size_t disassembleProperty(CodeObject* co, uint8_t opcode, size_t offset) {
       dumpBytes(co, offset, 2);
       printOpCode(opcode);
-      auto constIndex = co->code[offset + 1];
-      std::cout << (int)constIndex << " ("
+      auto constIndex = co->getCode()[offset + 1];
+      out << (int)constIndex << " ("
           << AS_CPPSTRING(co->constants[constIndex]) << ")";
       return offset + 2;
   }
@@ -175,8 +215,8 @@ class EvaDisassembler {
   size_t disassembleCell(CodeObject* co, uint8_t opcode, size_t offset) {
       dumpBytes(co, offset, 2);
       printOpCode(opcode);
-      auto cellIndex = co->code[offset + 1];
-      std::cout << (int)cellIndex << " ("
+      auto cellIndex = co->getCode()[offset + 1];
+      out << (int)cellIndex << " ("
           << co->cellNames[cellIndex] << ")";
       return offset + 2;
   }
@@ -193,23 +233,24 @@ class EvaDisassembler {
    * Dumps raw memory from the bytecode.
    */
   void dumpBytes(CodeObject* co, size_t offset, size_t count) {
-      std::ios_base::fmtflags f(std::cout.flags());
+      std::ios_base::fmtflags f(out.flags());
       std::stringstream ss;
-      for (suto i = 0; i < count; i++) {
+      for (auto i = 0; i < count; i++) {
           ss << std::uppercase << std::hex << std::setfill('0') << std::setw(2)
-              << (((int)co->code[offset + 1]) & 0xFF) << " ";
+              << (((int)co->getCode()[offset + i]) & 0xFF) << " ";
       }
-      std::cout << std::left << std::setfill(' ') << std::setw(12) << ss.str();
-      std::cout.flags(f);
+      out << std::left << std::setfill(' ') << std::setw(12) << ss.str();
+      out.flags(f);
   }
 
   /**
    * Prints opcode.
    */
   void printOpCode(uint8_t opcode) {
-    std::cout << std::left << std::setfill(' ') << std::setw(20)
+    std::ios_base::fmtflags f(out.flags());
+    out << std::left << std::setfill(' ') << std::setw(20)
               << opcodeToString(opcode) << " ";
-    std::cout.flags(f);
+    out.flags(f);
   }
 
   /**
@@ -218,9 +259,9 @@ class EvaDisassembler {
   size_t disassembleCompare(CodeObject* co, uint8_t opcode, size_t offset) {
       dumpBytes(co, offset, 2);
       printOpCode(opcode);
-      auto compareOP = co->code[offset + 1];
-      std::cout << (int)compareOp << " (";
-      std::cout << inverseCompareOps_[compareOp] << ")";
+      auto compareOp = co->getCode()[offset + 1];
+      out << (int)compareOp << " (";
+      out << inverseCompareOps_[compareOp] << ")";
       return offset + 2;
   }
 
@@ -228,13 +269,13 @@ class EvaDisassembler {
    * Disassembles conditional jump.
    */
   size_t disassembleJump(CodeObject* co, uint8_t opcode, size_t offset) {
-      std::ios_base::fmtflags f(std::cout.flags());
+      std::ios_base::fmtflags f(out.flags());
       dumpBytes(co, offset, 3);
       printOpCode(opcode);
       uint16_t address = readWordAtOffset(co, offset + 1);
-      std::cout << std::uppercase << std::hex << std::setfill('0') << std::right
+      out << std::uppercase << std::hex << std::setfill('0') << std::right
                 << std::setw(4) << (int)address << " ";
-      std::cout.flags(f);
+      out.flags(f);
       return offset + 3; // Instruction + 2 bytes address
   }
 
@@ -242,7 +283,7 @@ class EvaDisassembler {
    * Reads a word at offset.
    */
   uint16_t readWordAtOffset(CodeObject* co, size_t offset) {
-    return (uint16_t)((co->code[offset] << 8) | co->code[offset + 1]);
+    return (uint16_t)((co->getCode()[offset] << 8) | co->getCode()[offset + 1]);
   }
 
   /**
@@ -250,6 +291,11 @@ class EvaDisassembler {
    */
   std::shared_ptr<Global> global;
 
+  /**
+   * Output stream.
+   */
+  std::ostream& out;
+
   static std::array<std::string, 6> inverseCompareOps_;
 };
 
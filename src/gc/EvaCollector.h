@@ -46,36 +46,157 @@ struct EvaCollector {
 
   /**
    * Returns all pointers within this object.
+   *
+   * Tracing is driven by the object type: every kind
+   * of heap object reports all of its outgoing references.
    */
   std::set<Traceable *> getPointers(const Traceable *object) {
       std::set<Traceable*> pointers;
       auto evaValue = OBJECT((Object*)object);
-      // Function cells are traced
-      if (IS_FUNCTION(evaValue)) {
-          auto fn = AS_FNCTION(evaValue);
-          for (auto& cell : fn->cells) {
-              pointers.insert((Traceable*)cell);
+      switch (AS_OBJECT(evaValue)->type) {
+          // Leaf objects, no outgoing references
+          case ObjectType::STRING:
+          case ObjectType::NATIVE:
+          case ObjectType::FLOAT64_ARRAY:
+          case ObjectType::CHANNEL:
+              break;
+          // Code objects own the constant pool (nested code, strings, classes)
+          case ObjectType::CODE: {
+              auto co = AS_CODE(evaValue);
+              for (auto& constant : co->constants) {
+                  addValuePointer(pointers, constant);
+              }
+              break;
           }
-      }
-      // Instance properties
-      if (IS_INSTANCE(evaValue)) {
-          auto instance = AS_INSTANCE(evaValue);
-          for (auto& prop : instance->properties) {
-              if (IS_OBJECT(prop.second)) {
-                  pointers.insert((Traceable*)AS_OBJECT(prop.second));
+          // Functions reference their code and captured cells
+          case ObjectType::FUNCTION: {
+              auto fn = AS_FUNCTION(evaValue);
+              pointers.insert((Traceable*)fn->co);
+              for (auto& cell : fn->cells) {
+                  pointers.insert((Traceable*)cell);
               }
+              break;
+          }
+          // Cell value
+          case ObjectType::CELL: {
+              addValuePointer(pointers, AS_CELL(evaValue)->value);
+              break;
+          }
+          // Class properties (methods) and the super class
+          case ObjectType::CLASS: {
+              auto cls = AS_CLASS(evaValue);
+              for (auto& prop : cls->properties) {
+                  addValuePointer(pointers, prop.second);
+              }
+              if (cls->superClass != nullptr) {
+                  pointers.insert((Traceable*)cls->superClass);
+              }
+              break;
+          }
+          // Instance class and own properties
+          case ObjectType::INSTANCE: {
+              auto instance = AS_INSTANCE(evaValue);
+              pointers.insert((Traceable*)instance->cls);
+              for (auto& prop : instance->properties) {
+                  addValuePointer(pointers, prop.second);
+              }
+              break;
+          }
+          // Map keys (strings) and values
+          case ObjectType::MAP: {
+              for (auto& entry : AS_MAP(evaValue)->entries) {
+                  if (entry.distance >= 0) {
+                      addValuePointer(pointers, entry.key);
+                      addValuePointer(pointers, entry.value);
+                  }
+              }
+              break;
+          }
+          // Array elements
+          case ObjectType::ARRAY: {
+              for (auto& element : AS_ARRAY(evaValue)->elements) {
+                  addValuePointer(pointers, element);
+              }
+              break;
+          }
+          // Fiber result, or the live part of its stacks, and the waiters
+          case ObjectType::FIBER: {
+              auto fiber = AS_FIBER(evaValue);
+              addValuePointer(pointers, fiber->result);
+              if (fiber->state != FiberState::DONE) {
+                  for (auto entry = fiber->stack.data(); entry < fiber->sp; entry++) {
+                      addValuePointer(pointers, *entry);
+                  }
+                  for (auto& frame : fiber->callStack) {
+                      if (frame.fn != nullptr) {
+                          pointers.insert((Traceable*)frame.fn);
+                      }
+                  }
+                  if (fiber->fn != nullptr) {
+                      pointers.insert((Traceable*)fiber->fn);
+                  }
+              }
+              for (auto waiter : fiber->waiters) {
+                  pointers.insert((Traceable*)waiter);
+              }
+              break;
           }
       }
-
       return pointers;
   }
 
+  /**
+   * Adds the object referenced by the value (if any).
+   */
+  void addValuePointer(std::set<Traceable *> &pointers, const EvaValue &value) {
+      if (IS_OBJECT(value)) {
+          pointers.insert((Traceable*)AS_OBJECT(value));
+      }
+  }
+
+  /**
+   * Heap verifier: checks the heap invariants, and dies on violation.
+   *
+   * - every object is registered in the heap exactly once
+   * - no mark bits are left set outside of a collection cycle
+   * - accounted bytes match the sizes of all objects
+   * - all roots and all traced pointers point into the heap
+   */
+  void verify(const std::set<Traceable *> &roots) {
+      std::set<Traceable*> heap(Traceable::heap->objects.begin(), Traceable::heap->objects.end());
+      if (heap.size() != Traceable::heap->objects.size()) {
+          DIE << "[EvaCollector]: verify: duplicate heap entries.";
+      }
+      size_t bytes = 0;
+      for (auto& object : Traceable::heap->objects) {
+          if (object->marked) {
+              DIE << "[EvaCollector]: verify: stale mark bit on " << object;
+          }
+          bytes += object->size();
+          for (auto& p : getPointers(object)) {
+              if (heap.count(p) == 0) {
+                  DIE << "[EvaCollector]: verify: dangling pointer " << p
+                      << " in " << object;
+              }
+          }
+      }
+      if (bytes != Traceable::heap->bytesAllocated) {
+          DIE << "[EvaCollector]: verify: bytes allocated mismatch: "
+              << bytes << " != " << Traceable::heap->bytesAllocated;
+      }
+      for (auto& root : roots) {
+          if (heap.count(root) == 0) {
+              DIE << "[EvaCollector]: verify: dangling root " << root;
+          }
+      }
+  }
+
   /**
    * Sweep phase (reclaim).
    */
   void sweep() {
-      auto it = Traceable::objects.begin();
-      while (it != Traceable::objects.end()) {
+      auto it = Traceable::heap->objects.begin();
+      while (it != Traceable::heap->objects.end()) {
           auto object = (Traceable*)*it;
           if (object->marked) {
               // Alive object, reset the mark bit for future collection cycles
@@ -83,7 +204,7 @@ struct EvaCollector {
               ++it;
           }
           else {
-              it = Traceable::objects.erase(it);
+              it = Traceable::heap->objects.erase(it);
               delete(object);
           }
       }
@@ -0,0 +1,222 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * GC telemetry.
+ */
+
+#ifndef GCStats_h
+#define GCStats_h
+
+#include <array>
+#include <bit>
+#include <map>
+#include <sstream>
+#include <string>
+
+/**
+ * Pause histogram buckets per power of two: each power of two range of
+ * nanoseconds is split into 8 equal buckets, so a bucket is at most 1/8
+ * of its lower bound wide (percentiles are within 12.5%).
+ */
+#define GC_PAUSE_SUB_BUCKETS_LOG2 3
+#define GC_PAUSE_SUB_BUCKETS (1 << GC_PAUSE_SUB_BUCKETS_LOG2)
+
+/**
+ * Number of pause histogram buckets: exact values below
+ * GC_PAUSE_SUB_BUCKETS, then up to 2^48 ns (longer pauses
+ * go to the last bucket).
+ */
+#define GC_PAUSE_BUCKETS ((48 - GC_PAUSE_SUB_BUCKETS_LOG2 + 1) * GC_PAUSE_SUB_BUCKETS)
+
+/**
+ * GC stats: collections, pause times, allocation rate and live objects.
+ */
+struct GCStats {
+  /**
+   * Records a finished collection cycle.
+   */
+  void recordCycle(uint64_t pauseNs, size_t bytesBefore, size_t bytesAfter) {
+      collections++;
+      // Pause histogram
+      pauseHistogram[pauseBucket(pauseNs)]++;
+      totalPause += pauseNs;
+      if (pauseNs > maxPause) {
+          maxPause = pauseNs;
+      }
+      // Allocation since the previous cycle, and reclaimed memory
+      lastBytesAllocated = bytesBefore > liveBytes ? bytesBefore - liveBytes : 0;
+      lastBytesFreed = bytesBefore - bytesAfter;
+      totalBytesAllocated += lastBytesAllocated;
+      totalBytesFreed += lastBytesFreed;
+      liveBytes = bytesAfter;
+      // Live objects per type
+      liveObjects.clear();
+      for (const auto& object : Traceable::heap->objects) {
+          liveObjects[((Object*)object)->type]++;
+      }
+  }
+
+  /**
+   * Histogram bucket of the pause.
+   */
+  static size_t pauseBucket(uint64_t pauseNs) {
+      if (pauseNs < GC_PAUSE_SUB_BUCKETS) {
+          return pauseNs;
+      }
+      // Power of two range, and the sub-bucket within it
+      size_t shift = std::bit_width(pauseNs) - 1 - GC_PAUSE_SUB_BUCKETS_LOG2;
+      size_t bucket = (shift + 1) * GC_PAUSE_SUB_BUCKETS +
+                      (pauseNs >> shift) - GC_PAUSE_SUB_BUCKETS;
+      return bucket < GC_PAUSE_BUCKETS ? bucket : GC_PAUSE_BUCKETS - 1;
+  }
+
+  /**
+   * Lowest pause (ns) counted by the histogram bucket.
+   */
+  static uint64_t pauseBucketLower(size_t bucket) {
+      if (bucket < GC_PAUSE_SUB_BUCKETS) {
+          return bucket;
+      }
+      size_t shift = bucket / GC_PAUSE_SUB_BUCKETS - 1;
+      return (uint64_t)(GC_PAUSE_SUB_BUCKETS + bucket % GC_PAUSE_SUB_BUCKETS) << shift;
+  }
+
+  /**
+   * Returns pause percentile (0..100) in nanoseconds.
+   *
+   * The result is the upper bound of the histogram bucket
+   * containing the percentile (at most 12.5% above the pause),
+   * capped by the max pause.
+   */
+  uint64_t pausePercentile(double percentile) {
+      if (collections == 0) {
+          return 0;
+      }
+      auto rank = (size_t)(percentile / 100.0 * collections);
+      if (rank >= collections) {
+          rank = collections - 1;
+      }
+      size_t seen = 0;
+      for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+          seen += pauseHistogram[i];
+          if (seen > rank) {
+              auto upper = i + 1 < GC_PAUSE_BUCKETS ? pauseBucketLower(i + 1) - 1 : maxPause;
+              return upper < maxPause ? upper : maxPause;
+          }
+      }
+      return maxPause;
+  }
+
+  /**
+   * Returns a stat by name (used by the `gc-stat` native).
+   *
+   * Live object counts are named "live.<TYPE>", e.g. "live.INSTANCE".
+   */
+  double get(const std::string& name) {
+      if (name == "collections") return (double)collections;
+      if (name == "pause.p50") return (double)pausePercentile(50);
+      if (name == "pause.p99") return (double)pausePercentile(99);
+      if (name == "pause.max") return (double)maxPause;
+      if (name == "pause.total") return (double)totalPause;
+      if (name == "bytes.allocated") return (double)lastBytesAllocated;
+      if (name == "bytes.freed") return (double)lastBytesFreed;
+      if (name == "bytes.allocated.total") return (double)totalBytesAllocated;
+      if (name == "bytes.freed.total") return (double)totalBytesFreed;
+      if (name == "bytes.live") return (double)liveBytes;
+      for (const auto& [type, count] : liveObjects) {
+          if (name == "live." + objectTypeToString(type)) {
+              return (double)count;
+          }
+      }
+      if (name.rfind("live.", 0) == 0) {
+          return 0;
+      }
+      DIE << "[GCStats]: unknown stat " << name;
+      return 0; // Unreachable
+  }
+
+  /**
+   * JSON dump.
+   */
+  std::string toJSON() {
+      std::stringstream ss;
+      ss << "{\n"
+         << "  \"collections\": " << collections << ",\n"
+         << "  \"pause_ns\": {\"p50\": " << pausePercentile(50)
+         << ", \"p99\": " << pausePercentile(99) << ", \"max\": " << maxPause
+         << ", \"total\": " << totalPause << "},\n"
+         << "  \"pause_histogram_ns\": {";
+      auto first = true;
+      for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+          if (pauseHistogram[i] == 0) {
+              continue;
+          }
+          ss << (first ? "" : ", ") << "\"" << pauseBucketLower(i)
+             << "\": " << pauseHistogram[i];
+          first = false;
+      }
+      ss << "},\n"
+         << "  \"bytes\": {\"allocated_last\": " << lastBytesAllocated
+         << ", \"freed_last\": " << lastBytesFreed
+         << ", \"allocated_total\": " << totalBytesAllocated
+         << ", \"freed_total\": " << totalBytesFreed
+         << ", \"live\": " << liveBytes << "},\n"
+         << "  \"live_objects\": {";
+      first = true;
+      for (const auto& [type, count] : liveObjects) {
+          ss << (first ? "" : ", ") << "\"" << objectTypeToString(type)
+             << "\": " << count;
+          first = false;
+      }
+      ss << "}\n}\n";
+      return ss.str();
+  }
+
+  /**
+   * Total number of collections.
+   */
+  size_t collections = 0;
+
+  /**
+   * Pause time histogram (log-linear buckets, ns).
+   */
+  std::array<size_t, GC_PAUSE_BUCKETS> pauseHistogram{};
+
+  /**
+   * Longest and total pause (ns).
+   */
+  uint64_t maxPause = 0;
+  uint64_t totalPause = 0;
+
+  /**
+   * Bytes allocated before, and freed by the last cycle.
+   */
+  size_t lastBytesAllocated = 0;
+  size_t lastBytesFreed = 0;
+
+  /**
+   * Bytes allocated and freed over all cycles.
+   */
+  size_t totalBytesAllocated = 0;
+  size_t totalBytesFreed = 0;
+
+  /**
+   * Live bytes after the last cycle.
+   */
+  size_t liveBytes = 0;
+
+  /**
+   * Live objects per type after the last cycle.
+   */
+  std::map<ObjectType, size_t> liveObjects;
+};
+
+#endif
@@ -0,0 +1,310 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Eva parser (S-expression reader).
+ */
+
+#ifndef EvaParser_h
+#define EvaParser_h
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../Logger.h"
+#include "../bytecode/BinaryIO.h"
+#include "Exp.h"
+
+/**
+ * Eva parser: a hand-written single-pass reader.
+ *
+ * Grammar:
+ *
+ *   Program : Exp*
+ *   Exp     : Atom | List
+ *   Atom    : NUMBER | STRING | SYMBOL
+ *   List    : '(' Exp* ')'
+ *
+ * Tokens:
+ *
+ *   NUMBER  : [+-]? (\d+ | \d*\.\d+ | \d+\.\d*) ([eE][+-]?\d+)?
+ *           | [+-]? 0[xX][0-9a-fA-F]+
+ *   STRING  : "[^"]*"
+ *   SYMBOL  : [\w\-+*=!<>/]+
+ *
+ * Whitespace, line and block comments are skipped.
+ *
+ * The program is returned as (begin Exp*). Lists are built in place
+ * in the arena (open lists are the arena's pending items), so the
+ * reader doesn't recurse, and nesting isn't bounded by the C stack.
+ * Expressions record their source line (of the first character),
+ * errors report lines and byte offsets in the source.
+ */
+class EvaParser {
+ public:
+  /**
+   * Parses the program (invalidates the previous AST).
+   */
+  Exp* parse(std::string_view source) {
+      arena_.reset();
+      source_ = source;
+      pos_ = 0;
+      line_ = 1;
+      linePos_ = 0;
+      opened_.clear();
+
+      arena_.openList();
+      arena_.append(arena_.symbol("begin"));
+
+      while (skipSpace()) {
+          auto c = source_[pos_];
+          if (c == '(') {
+              opened_.push_back(lineAt(pos_));
+              pos_++;
+              arena_.openList();
+          } else if (c == ')') {
+              if (opened_.empty()) {
+                  error("Unexpected ')'");
+              }
+              pos_++;
+              auto list = arena_.closeList();
+              list->line = opened_.back();
+              opened_.pop_back();
+              arena_.append(list);
+          } else {
+              auto line = lineAt(pos_);
+              auto exp = atom();
+              exp->line = line;
+              arena_.append(exp);
+          }
+      }
+
+      if (!opened_.empty()) {
+          error("Unexpected end of input, list opened at line " +
+                std::to_string(opened_.back()) + " is not closed");
+      }
+      return arena_.closeList();
+  }
+
+ private:
+  /**
+   * Skips whitespace and comments, returns false at the end of input.
+   */
+  bool skipSpace() {
+      while (pos_ < source_.size()) {
+          auto c = source_[pos_];
+          if (isSpace(c)) {
+              pos_++;
+          } else if (source_.compare(pos_, 2, "//") == 0) {
+              auto end = source_.find('\n', pos_);
+              pos_ = end == std::string_view::npos ? source_.size() : end;
+          } else if (source_.compare(pos_, 2, "/*") == 0) {
+              auto end = source_.find("*/", pos_ + 2);
+              if (end == std::string_view::npos) {
+                  error("Unterminated comment");
+              }
+              pos_ = end + 2;
+          } else {
+              return true;
+          }
+      }
+      return false;
+  }
+
+  /**
+   * Reads an atom: number, string or symbol.
+   */
+  Exp* atom() {
+      auto start = pos_;
+      auto c = source_[pos_];
+
+      // Numbers:
+      if (isNumberStart()) {
+          while (pos_ < source_.size() &&
+                 (isSymbolChar(source_[pos_]) || source_[pos_] == '.')) {
+              pos_++;
+          }
+          return arena_.number(number(source_.substr(start, pos_ - start)));
+      }
+
+      // Strings:
+      if (c == '"') {
+          auto end = source_.find('"', pos_ + 1);
+          if (end == std::string_view::npos) {
+              error("Unterminated string");
+          }
+          pos_ = end + 1;
+          return arena_.string(source_.substr(start + 1, end - start - 1));
+      }
+
+      // Symbols:
+      while (pos_ < source_.size() && isSymbolChar(source_[pos_])) {
+          pos_++;
+      }
+      if (pos_ == start) {
+          error(std::string("Unexpected character '") + c + "'");
+      }
+      return arena_.symbol(source_.substr(start, pos_ - start));
+  }
+
+  /**
+   * Whether a number starts at the current position: a digit, or
+   * a sign or a dot followed by a digit (otherwise `-`, `+` are symbols).
+   */
+  bool isNumberStart() {
+      auto next = pos_;
+      if (source_[next] == '+' || source_[next] == '-') {
+          next++;
+      }
+      if (next < source_.size() && source_[next] == '.') {
+          next++;
+      }
+      return next < source_.size() && isDigit(source_[next]);
+  }
+
+  /**
+   * Parses a numeric literal to the nearest double: decimal and hex
+   * integers (exact up to 2^53, rounded above), decimals and exponent
+   * forms.
+   */
+  double number(std::string_view token) {
+      auto negative = token[0] == '-';
+      auto digits = token[0] == '-' || token[0] == '+' ? token.substr(1) : token;
+      auto first = digits.data();
+      auto last = digits.data() + digits.size();
+      std::from_chars_result result;
+      double value;
+
+      // Hex integers (hex float forms are not literals):
+      if (digits.size() > 2 && digits[0] == '0' &&
+          (digits[1] == 'x' || digits[1] == 'X')) {
+          if (digits.find_first_not_of("0123456789abcdefABCDEF", 2) !=
+              std::string_view::npos) {
+              pos_ -= token.size();
+              error("Invalid number: " + std::string(token));
+          }
+          result = std::from_chars(first + 2, last, value, std::chars_format::hex);
+      }
+
+      // Decimal integers, decimals, exponents:
+      else {
+          result = std::from_chars(first, last, value);
+      }
+
+      if (result.ec == std::errc::result_out_of_range) {
+          pos_ -= token.size();
+          error("Number out of range: " + std::string(token));
+      }
+      if (result.ec != std::errc() || result.ptr != last) {
+          pos_ -= token.size();
+          error("Invalid number: " + std::string(token));
+      }
+      return negative ? -value : value;
+  }
+
+  /**
+   * Returns the line of the offset. Offsets are visited in order,
+   * so the newlines are counted once for the whole source.
+   */
+  uint32_t lineAt(size_t offset) {
+      if (offset > linePos_) {
+          line_ += std::count(source_.begin() + linePos_,
+                              source_.begin() + offset, '\n');
+          linePos_ = offset;
+      }
+      return line_;
+  }
+
+  /**
+   * Reports a syntax error at the current position.
+   */
+  [[noreturn]] void error(const std::string& message) {
+      DIE << "Syntax error at line " << lineAt(pos_) << " (byte " << pos_
+          << "): " << message << "\n";
+      exit(EXIT_FAILURE);
+  }
+
+  static bool isSpace(char c) {
+      return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+             c == '\v';
+  }
+
+  static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+  static bool isSymbolChar(char c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isDigit(c) ||
+             c == '_' || c == '-' || c == '+' || c == '*' || c == '=' ||
+             c == '!' || c == '<' || c == '>' || c == '/';
+  }
+
+  /**
+   * Expressions of the last parsed program.
+   */
+  ExpArena arena_;
+
+  /**
+   * Source and the current position.
+   */
+  std::string_view source_;
+  size_t pos_ = 0;
+
+  /**
+   * Line of the last visited offset.
+   */
+  uint32_t line_ = 1;
+  size_t linePos_ = 0;
+
+  /**
+   * Lines of the open lists.
+   */
+  std::vector<uint32_t> opened_;
+};
+
+/**
+ * Program source file: mapped, or read into the buffer if the
+ * file can't be mapped (e.g. pipes, empty files).
+ */
+struct SourceFile {
+  /**
+   * Opens the file, returns false if it can't be read.
+   */
+  bool open(const std::string& fileName) {
+      size_t size;
+      auto data = files_.map(fileName, size);
+      if (data != nullptr) {
+          text = std::string_view((const char*)data, size);
+          return true;
+      }
+      std::ifstream file(fileName, std::ios::binary);
+      if (!file) {
+          return false;
+      }
+      buffer_.assign(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+      text = buffer_;
+      return true;
+  }
+
+  /**
+   * Source text.
+   */
+  std::string_view text;
+
+ private:
+  MappedFiles files_;
+  std::string buffer_;
+};
+
+#endif
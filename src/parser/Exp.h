@@ -0,0 +1,221 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * AST: expressions allocated in an arena.
+ */
+
+#ifndef Exp_h
+#define Exp_h
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Number of expressions in an arena chunk.
+ */
+#define EXP_ARENA_CHUNK 4096
+
+/**
+ * Expression type.
+ */
+enum class ExpType {
+  NUMBER,
+  STRING,
+  SYMBOL,
+  LIST,
+};
+
+struct Exp;
+
+/**
+ * List of expressions: a contiguous slice in the arena.
+ */
+struct ExpList {
+  Exp* items = nullptr;
+  size_t count = 0;
+
+  Exp& operator[](size_t index) const;
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  Exp* begin() const;
+  Exp* end() const;
+};
+
+/**
+ * Expression.
+ *
+ * Nodes are immutable and owned by the arena. Strings are interned
+ * in the arena, and lists reference their items in place, so
+ * copying a node is shallow (never copies a subtree).
+ *
+ * The source line is set by the parser (0 for synthesized nodes,
+ * which take the line of the enclosing expression).
+ */
+struct Exp {
+  ExpType type;
+  uint32_t line = 0;
+
+  double number = 0;
+  const std::string& string;
+  ExpList list;
+
+  // Numbers:
+  Exp(double number)
+      : type(ExpType::NUMBER), number(number), string(emptyString()) {}
+
+  // Strings, Symbols (interned):
+  Exp(ExpType type, const std::string& string) : type(type), string(string) {}
+
+  // Lists:
+  Exp(ExpList list)
+      : type(ExpType::LIST), string(emptyString()), list(list) {}
+
+  static const std::string& emptyString() {
+      static const std::string empty;
+      return empty;
+  }
+};
+
+inline Exp& ExpList::operator[](size_t index) const { return items[index]; }
+inline Exp* ExpList::begin() const { return items; }
+inline Exp* ExpList::end() const { return items + count; }
+
+/**
+ * Expression arena: bump-allocates nodes in chunks, interns strings,
+ * and builds lists in place from a stack of pending items.
+ */
+class ExpArena {
+ public:
+  /**
+   * Frees all expressions (invalidates the previous AST).
+   */
+  void reset() {
+      chunks_.clear();
+      chunk_ = nullptr;
+      used_ = EXP_ARENA_CHUNK;
+      strings_.clear();
+      pending_.clear();
+      marks_.clear();
+  }
+
+  Exp* number(double value) { return new (allocate(1)) Exp(value); }
+
+  Exp* string(std::string_view text) {
+      return new (allocate(1)) Exp(ExpType::STRING, intern(text));
+  }
+
+  Exp* symbol(std::string_view name) {
+      return new (allocate(1)) Exp(ExpType::SYMBOL, intern(name));
+  }
+
+  /**
+   * Makes a list of the items (shallow copies of the nodes).
+   */
+  Exp* list(const Exp* const* items, size_t count) {
+      auto slice = allocate(count);
+      for (size_t i = 0; i < count; i++) {
+          new (slice + i) Exp(*items[i]);
+      }
+      return new (allocate(1)) Exp(ExpList{slice, count});
+  }
+
+  Exp* list(const std::vector<const Exp*>& items) {
+      return list(items.data(), items.size());
+  }
+
+  /**
+   * Starts a list: items are appended until the matching closeList.
+   */
+  void openList() { marks_.push_back(pending_.size()); }
+
+  void append(const Exp* exp) { pending_.push_back(exp); }
+
+  Exp* closeList() {
+      auto mark = marks_.back();
+      marks_.pop_back();
+      auto exp = list(pending_.data() + mark, pending_.size() - mark);
+      pending_.resize(mark);
+      return exp;
+  }
+
+  /**
+   * Interns a string.
+   */
+  const std::string& intern(std::string_view text) {
+      auto it = strings_.find(text);
+      if (it == strings_.end()) {
+          it = strings_.emplace(text).first;
+      }
+      return *it;
+  }
+
+ private:
+  /**
+   * Allocates uninitialized storage for the expressions.
+   */
+  Exp* allocate(size_t count) {
+      // Oversized lists get a dedicated chunk
+      if (count > EXP_ARENA_CHUNK) {
+          chunks_.push_back(std::make_unique<Storage[]>(count));
+          return (Exp*)chunks_.back().get();
+      }
+      if (used_ + count > EXP_ARENA_CHUNK) {
+          chunks_.push_back(std::make_unique<Storage[]>(EXP_ARENA_CHUNK));
+          chunk_ = chunks_.back().get();
+          used_ = 0;
+      }
+      auto items = (Exp*)(chunk_ + used_);
+      used_ += count;
+      return items;
+  }
+
+  /**
+   * Raw storage for one expression.
+   */
+  struct Storage {
+      alignas(Exp) unsigned char bytes[sizeof(Exp)];
+  };
+
+  /**
+   * Transparent string hash (lookups by string_view).
+   */
+  struct StringHash {
+      using is_transparent = void;
+      size_t operator()(std::string_view text) const {
+          return std::hash<std::string_view>{}(text);
+      }
+  };
+
+  /**
+   * All chunks, and the one being filled.
+   */
+  std::vector<std::unique_ptr<Storage[]>> chunks_;
+  Storage* chunk_ = nullptr;
+  size_t used_ = EXP_ARENA_CHUNK;
+
+  /**
+   * Interned strings.
+   */
+  std::unordered_set<std::string, StringHash, std::equal_to<>> strings_;
+
+  /**
+   * Items of the open lists, and the list starts.
+   */
+  std::vector<const Exp*> pending_;
+  std::vector<size_t> marks_;
+};
+
+#endif
@@ -0,0 +1,419 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Channels: message passing between isolates.
+ */
+
+#ifndef Channel_h
+#define Channel_h
+
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../Logger.h"
+#include "../bytecode/BinaryIO.h"
+#include "EvaValue.h"
+
+/**
+ * Max channel capacity (messages).
+ */
+#define CHANNEL_MAX_CAPACITY (1 << 20)
+
+struct Channel;
+
+/**
+ * Message: structured clone of a value.
+ *
+ * Numbers, booleans, arrays and maps are encoded in the bytes.
+ * Strings and Float64Array storage are kept aside and moved into
+ * the receiver's objects, so they are not re-encoded.
+ */
+struct ChannelMessage {
+  std::string bytes;
+  std::vector<std::string> strings;
+  std::vector<std::vector<double>> arrays;
+  std::vector<std::shared_ptr<Channel>> channels;
+};
+
+/**
+ * Channel: bounded multi-producer multi-consumer queue shared
+ * by the isolates of the process.
+ *
+ * The queue is a lock-free ring: each slot has a sequence number
+ * telling whether it's free for the producer of the position, or
+ * filled for the consumer of the position; producers and consumers
+ * claim positions with a CAS on their counter.
+ *
+ * Isolates with fibers waiting on a full or empty channel register
+ * their event loop wake fd, and are notified after each send and
+ * receive. The lock is only taken while there are waiters.
+ */
+struct Channel {
+  /**
+   * Capacity is rounded up to a power of two.
+   */
+  explicit Channel(size_t capacity) {
+      size_t slots = 2;
+      while (slots < capacity) {
+          slots *= 2;
+      }
+      slots_ = std::make_unique<Slot[]>(slots);
+      for (size_t i = 0; i < slots; i++) {
+          slots_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+      mask_ = slots - 1;
+  }
+
+  /**
+   * Enqueues the message (moved), false if the channel is full.
+   */
+  bool trySend(ChannelMessage& message) {
+      auto pos = sendPos_.load(std::memory_order_relaxed);
+      for (;;) {
+          auto& slot = slots_[pos & mask_];
+          auto sequence = slot.sequence.load(std::memory_order_acquire);
+          auto diff = (intptr_t)sequence - (intptr_t)pos;
+          if (diff == 0) {
+              if (sendPos_.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed)) {
+                  slot.message = std::move(message);
+                  slot.sequence.store(pos + 1, std::memory_order_release);
+                  notify();
+                  return true;
+              }
+          } else if (diff < 0) {
+              return false;
+          } else {
+              pos = sendPos_.load(std::memory_order_relaxed);
+          }
+      }
+  }
+
+  /**
+   * Dequeues a message, false if the channel is empty.
+   */
+  bool tryReceive(ChannelMessage& message) {
+      auto pos = receivePos_.load(std::memory_order_relaxed);
+      for (;;) {
+          auto& slot = slots_[pos & mask_];
+          auto sequence = slot.sequence.load(std::memory_order_acquire);
+          auto diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+          if (diff == 0) {
+              if (receivePos_.compare_exchange_weak(pos, pos + 1,
+                                                    std::memory_order_relaxed)) {
+                  message = std::move(slot.message);
+                  slot.message = ChannelMessage{};
+                  slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                  notify();
+                  return true;
+              }
+          } else if (diff < 0) {
+              return false;
+          } else {
+              pos = receivePos_.load(std::memory_order_relaxed);
+          }
+      }
+  }
+
+  /**
+   * Registers the wake fd of a waiting isolate. The caller retries
+   * the operation after that, so a concurrent send or receive is
+   * either seen by the retry, or notifies the fd.
+   */
+  void addWaiter(int fd) {
+      std::lock_guard<std::mutex> lock(waitersMutex_);
+      waiters_.insert(fd);
+      waitersCount_.fetch_add(1, std::memory_order_seq_cst);
+  }
+
+  void removeWaiter(int fd) {
+      std::lock_guard<std::mutex> lock(waitersMutex_);
+      waiters_.erase(waiters_.find(fd));
+      waitersCount_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  /**
+   * Opens the channel shared under the name, creating it with
+   * the capacity on first use.
+   */
+  static std::shared_ptr<Channel> open(const std::string& name, size_t capacity) {
+      static std::mutex mutex;
+      static std::map<std::string, std::shared_ptr<Channel>> channels;
+      std::lock_guard<std::mutex> lock(mutex);
+      auto& channel = channels[name];
+      if (channel == nullptr) {
+          channel = std::make_shared<Channel>(capacity);
+      }
+      return channel;
+  }
+
+ private:
+  /**
+   * Wakes up the waiting isolates.
+   */
+  void notify() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waitersCount_.load(std::memory_order_relaxed) == 0) {
+          return;
+      }
+      std::lock_guard<std::mutex> lock(waitersMutex_);
+      uint64_t posted = 1;
+      for (auto fd = waiters_.begin(); fd != waiters_.end();
+           fd = waiters_.upper_bound(*fd)) {
+          ::write(*fd, &posted, sizeof(posted));
+      }
+  }
+
+  struct Slot {
+      std::atomic<size_t> sequence;
+      ChannelMessage message;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+
+  // Producer and consumer positions (on separate cache lines)
+  alignas(64) std::atomic<size_t> sendPos_{0};
+  alignas(64) std::atomic<size_t> receivePos_{0};
+
+  // Wake fds of the isolates waiting on the channel
+  alignas(64) std::atomic<size_t> waitersCount_{0};
+  std::mutex waitersMutex_;
+  std::multiset<int> waiters_;
+};
+
+/**
+ * Channel object: the isolate's handle to a shared channel.
+ */
+struct ChannelObject : public Object {
+  ChannelObject(std::shared_ptr<Channel> channel)
+      : Object(ObjectType::CHANNEL), channel(channel) {}
+  std::shared_ptr<Channel> channel;
+};
+
+// ----------------------------------------------------------------
+
+/**
+ * Message value tag.
+ */
+enum class MessageTag : uint8_t {
+  NUMBER,
+  BOOLEAN,
+  STRING,
+  FLOAT64_ARRAY,
+  ARRAY,
+  MAP,
+  CHANNEL,
+  // Object seen before (shared or cyclic references)
+  REF,
+};
+
+/**
+ * Structured clone of values into messages.
+ *
+ * Float64Arrays are transferred: the sender's array is left empty.
+ * Strings are copied once into the message, and moved into the
+ * receiver's string. Functions, classes, instances and fibers
+ * belong to the isolate, and can't be sent.
+ */
+class MessageCodec {
+ public:
+  /**
+   * Encodes the value into the message.
+   */
+  void encode(const EvaValue& value, ChannelMessage& message) {
+      ids_.clear();
+      message_ = &message;
+      BinaryWriter out;
+      write(out, value);
+      message.bytes = std::move(out.data);
+  }
+
+  /**
+   * Decodes the message (its storage is moved into the objects).
+   *
+   * The objects are allocated without GC: the caller triggers
+   * the collection before decoding.
+   */
+  EvaValue decode(ChannelMessage& message) {
+      objects_.clear();
+      message_ = &message;
+      BinaryReader in((const uint8_t*)message.bytes.data(),
+                      (const uint8_t*)message.bytes.data() + message.bytes.size());
+      auto value = read(in);
+      if (!in.ok) {
+          DIE << "[Channel]: Malformed message";
+      }
+      return value;
+  }
+
+ private:
+  void write(BinaryWriter& out, const EvaValue& value) {
+      if (IS_NUMBER(value)) {
+          out.u8((uint8_t)MessageTag::NUMBER);
+          out.f64(AS_NUMBER(value));
+          return;
+      }
+      if (IS_BOOLEAN(value)) {
+          out.u8((uint8_t)MessageTag::BOOLEAN);
+          out.u8(AS_BOOLEAN(value));
+          return;
+      }
+      auto object = AS_OBJECT(value);
+      auto seen = ids_.find(object);
+      if (seen != ids_.end()) {
+          out.u8((uint8_t)MessageTag::REF);
+          out.u32(seen->second);
+          return;
+      }
+      auto id = (uint32_t)ids_.size();
+      ids_[object] = id;
+      switch (object->type) {
+          case ObjectType::STRING:
+              out.u8((uint8_t)MessageTag::STRING);
+              out.u32(message_->strings.size());
+              message_->strings.push_back(AS_CPPSTRING(value));
+              break;
+          case ObjectType::FLOAT64_ARRAY: {
+              auto array = AS_FLOAT64_ARRAY(value);
+              out.u8((uint8_t)MessageTag::FLOAT64_ARRAY);
+              out.u32(message_->arrays.size());
+              array->shrink(array->data.capacity() * sizeof(double));
+              message_->arrays.push_back(std::move(array->data));
+              array->data = {};
+              break;
+          }
+          case ObjectType::ARRAY: {
+              auto& elements = AS_ARRAY(value)->elements;
+              out.u8((uint8_t)MessageTag::ARRAY);
+              out.u32(elements.size());
+              for (const auto& element : elements) {
+                  write(out, element);
+              }
+              break;
+          }
+          case ObjectType::MAP: {
+              auto map = AS_MAP(value);
+              out.u8((uint8_t)MessageTag::MAP);
+              out.u32(map->count);
+              for (const auto& entry : map->entries) {
+                  if (entry.distance >= 0) {
+                      write(out, entry.key);
+                      write(out, entry.value);
+                  }
+              }
+              break;
+          }
+          case ObjectType::CHANNEL:
+              out.u8((uint8_t)MessageTag::CHANNEL);
+              out.u32(message_->channels.size());
+              message_->channels.push_back(AS_CHANNEL(value)->channel);
+              break;
+          default:
+              DIE << "[Channel]: Can't send " << evaValueToTypeString(value)
+                  << " to another isolate";
+      }
+  }
+
+  EvaValue read(BinaryReader& in) {
+      auto tag = (MessageTag)in.u8();
+      switch (tag) {
+          case MessageTag::NUMBER:
+              return NUMBER(in.f64());
+          case MessageTag::BOOLEAN:
+              return BOOLEAN(in.u8() != 0);
+          case MessageTag::REF: {
+              auto id = in.u32();
+              if (id >= objects_.size()) {
+                  in.ok = false;
+                  return BOOLEAN(false);
+              }
+              return objects_[id];
+          }
+          case MessageTag::STRING: {
+              auto index = in.u32();
+              if (index >= message_->strings.size()) {
+                  in.ok = false;
+                  return BOOLEAN(false);
+              }
+              auto value = ALLOC_STRING("");
+              AS_STRING(value)->string = std::move(message_->strings[index]);
+              objects_.push_back(value);
+              return value;
+          }
+          case MessageTag::FLOAT64_ARRAY: {
+              auto index = in.u32();
+              if (index >= message_->arrays.size()) {
+                  in.ok = false;
+                  return BOOLEAN(false);
+              }
+              auto value = ALLOC_FLOAT64_ARRAY(0);
+              auto array = AS_FLOAT64_ARRAY(value);
+              array->data = std::move(message_->arrays[index]);
+              array->grow(array->data.capacity() * sizeof(double));
+              objects_.push_back(value);
+              return value;
+          }
+          case MessageTag::ARRAY: {
+              auto value = ALLOC_ARRAY();
+              objects_.push_back(value);
+              auto count = in.count();
+              auto array = AS_ARRAY(value);
+              array->reserve(count);
+              for (uint32_t i = 0; i < count && in.ok; i++) {
+                  array->push(read(in));
+              }
+              return value;
+          }
+          case MessageTag::MAP: {
+              auto value = ALLOC_MAP();
+              objects_.push_back(value);
+              auto count = in.count();
+              for (uint32_t i = 0; i < count && in.ok; i++) {
+                  auto key = read(in);
+                  auto entryValue = read(in);
+                  AS_MAP(value)->set(key, entryValue);
+              }
+              return value;
+          }
+          case MessageTag::CHANNEL: {
+              auto index = in.u32();
+              if (index >= message_->channels.size()) {
+                  in.ok = false;
+                  return BOOLEAN(false);
+              }
+              auto value = ALLOC_CHANNEL(message_->channels[index]);
+              objects_.push_back(value);
+              return value;
+          }
+      }
+      in.ok = false;
+      return BOOLEAN(false);
+  }
+
+  /**
+   * Ids of the encoded objects, and the decoded objects by id.
+   */
+  std::unordered_map<Object*, uint32_t> ids_;
+  std::vector<EvaValue> objects_;
+
+  ChannelMessage* message_ = nullptr;
+};
+
+#endif
@@ -16,19 +16,35 @@
 #define EvaVM_h
 
 #include <array>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <span>
 #include <stack>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
 #include <vector>
 
 #include "../Logger.h"
+#include "../Tracer.h"
+#include "../bytecode/BytecodeCache.h"
 #include "../bytecode/OpCode.h"
 #include "../compiler/EvaCompiler.h"
 #include "../gc/EvaCollector.h"
+#include "../gc/GCStats.h"
 #include "../parser/EvaParser.h"
+#include "Channel.h"
 #include "EvaValue.h"
+#include "EventLoop.h"
+#include "Float64Kernels.h"
 #include "Global.h"
-
-using syntax::EvaParser;
+#include "HeapSnapshot.h"
+#include "NativeBinding.h"
+#include "OpcodeProfiler.h"
+#include "Program.h"
+#include "SamplingProfiler.h"
 
 /**
  * Reads the current byte in the bytecode
@@ -44,7 +60,7 @@ using syntax::EvaParser;
 /**
  * Converts bytecode index to a pointer.
  */
-#define TO_ADDRESS(index) (&fn->co->code[index])
+#define TO_ADDRESS(index) (fn->co->getCode() + index)
 
 /**
  * Gets a constant from the pool.
@@ -61,6 +77,18 @@ using syntax::EvaParser;
  */
 #define GC_TRESHOLD 1024
 
+/**
+ * Debug heap verifier: define EVA_VERIFY_HEAP to check
+ * the heap invariants before and after every collection.
+ */
+// #define EVA_VERIFY_HEAP
+
+/**
+ * Opcode profiler: define EVA_PROFILE to count executions and
+ * cycles of every instruction, and print the hot spots at exit.
+ */
+// #define EVA_PROFILE
+
 /**
  * Runtime allocation, can call GC.
  */
@@ -102,21 +130,19 @@ do {                                \
         res = v1 != v2;             \
         break;                      \
     }                               \
-    push(BOOLEAN(res))              \
+    push(BOOLEAN(res));             \
 } while (false)
 
 // --------------------------------------------------
 
 /**
- * Stack frame for function calls.
+ * Counts the nesting for the scope (also when a fatal error
+ * unwinds it, see ErrorHandler).
  */
-struct Frame {
-  // Return address of the caller (ip of the caller)
-  uint8_t* ra;
-  // Base pointer of the caller
-  EvaValue* bp;
-  // Reference to the running function
-  FunctionObject* fn;
+struct DepthScope {
+  DepthScope(size_t& depth) : depth(depth) { depth++; }
+  ~DepthScope() { depth--; }
+  size_t& depth;
 };
 
 // --------------------------------------------------
@@ -129,15 +155,28 @@ class EvaVM {
   EvaVM()
       : global(std::make_shared<Global>()),
         parser(std::make_unique<EvaParser>()),
-        compiler(std::make_unique<EvaCompiler>(global)),
-        collector(std::make_unique<EvaCollector>()) {
+        compiler(std::make_unique<EvaCompiler>(global, tracer.out())),
+        collector(std::make_unique<EvaCollector>()),
+        cache(std::make_unique<BytecodeCache>(global)),
+        snapshot(std::make_unique<HeapSnapshot>(global)) {
+    HeapScope scope(&heap);
     setGlobalVariables();
   }
 
   /**
-   * VM shutdown.
+   * VM shutdown: frees the objects of this VM only.
    */
-  ~EvaVM() { Traceable::cleanup(); }
+  ~EvaVM() {
+    HeapScope scope(&heap);
+#ifdef EVA_PROFILE
+    EvaDisassembler disassembler(global);
+    profiler.report(disassembler);
+#endif
+    Traceable::cleanup();
+  }
+
+  EvaVM(const EvaVM&) = delete;
+  EvaVM& operator=(const EvaVM&) = delete;
 
   //----------------------------------------------------
   // Stack operations:
@@ -146,7 +185,7 @@ class EvaVM {
    * Pushes a value onto the stack.
    */
   void push(const EvaValue& value) {
-      if ((size_t)(sp - stack.begin()) == STACK_LIMIT) {
+      if ((size_t)(sp - stack) == STACK_LIMIT) {
           DIE << "push(): stack overflow.\n";
       }
       *sp = value;
@@ -157,7 +196,7 @@ class EvaVM {
    * Pops a value from the stack.
    */
   EvaValue pop() {
-      if (sp == stack.begin()) {
+      if (sp == stack) {
           DIE << "pop(): empty stack.\n";
       }
       --sp;
@@ -168,7 +207,7 @@ class EvaVM {
    * Peeks an element from the stack.
    */
   EvaValue peek(size_t offset = 0) {
-      if (stack.size() == 0) {
+      if ((size_t)(sp - stack) <= offset) {
           DIE << "peek(): empty stack.\n";
       }
       return *(sp - 1 - offset);
@@ -178,7 +217,7 @@ class EvaVM {
    * Pops multiple values from the stack.
    */
   void popN(size_t count) {
-      if (stack.size() == 0) {
+      if ((size_t)(sp - stack) < count) {
           DIE << "popN(): empty stack.\n";
       }
       sp -= count;
@@ -188,41 +227,71 @@ class EvaVM {
   // GC operations:
 
   /**
-   * Obtains GC roots: variables on the stack, globals, constants.
+   * Obtains GC roots: variables on the stack, globals, executing code.
    */
   std::set<Traceable*> getGCRoots() {
     // Stack
       auto roots = getStackGCRoots();
 
-    // Constant pool
-      auto constantRoots = getConstantGCRoots();
-      roots.insert(constantRoots.begin(), constantRoots.end());
+    // Executing code (reaches all code objects and their constants)
+      auto codeRoots = getCodeGCRoots();
+      roots.insert(codeRoots.begin(), codeRoots.end());
     
     // Global
       auto globalRoots = getGlobalGCRoots();
-      root.insert(globalRoots.begin(), globalRoots.end());
+      roots.insert(globalRoots.begin(), globalRoots.end());
+
+#ifdef EVA_PROFILE
+    // Profiled code (disassembled in the report)
+      for (auto co : profiler.codeObjects()) {
+          roots.insert((Traceable*)co);
+      }
+#endif
       return roots;
   }
 
   /**
-   * Returns stack GC roots.
+   * Returns stack GC roots: the fibers (the collector traces their
+   * stacks), and the frames of the running fiber.
    */
   std::set<Traceable*> getStackGCRoots() {
       std::set<Traceable*> roots;
-      auto stackEntry = sp;
-      while (stackEntry-- != stack.begin()) {
-          if (IS_OBJECT(*stackEntry)) {
-              roots.insert((Traceable*)stackEntry->object);
+      if (fiber == nullptr) {
+          return roots;
+      }
+      // A fiber being switched out has them saved already (and the
+      // completed I/O may have pushed its result above them)
+      if (fiber->state == FiberState::RUNNING) {
+          saveRegisters();
+      }
+      roots.insert((Traceable*)fiber);
+      roots.insert((Traceable*)rootFiber);
+      for (auto liveFiber : liveFibers) {
+          roots.insert((Traceable*)liveFiber);
+      }
+      // (the sentinel frames of host calls have no function)
+      for (auto& frame : callStack) {
+          if (frame.fn != nullptr) {
+              roots.insert((Traceable*)frame.fn);
           }
       }
       return roots;
   }
 
   /**
-   * Returns GC roots for constants.
+   * Returns GC roots for the executing code: the main entry
+   * point, the compiled programs with live handles, and the
+   * currently running function. Callers in the
+   * call stack are kept alive by their slot on the stack.
    */
-  std::set<Traceable*> getConstantGCRoots() {
-      return compiler->getConstantObjects();
+  std::set<Traceable*> getCodeGCRoots() {
+      std::set<Traceable*> roots;
+      roots.insert((Traceable*)compiler->getMainFunction());
+      roots.insert((Traceable*)fn);
+      for (auto main : *programRoots) {
+          roots.insert((Traceable*)main);
+      }
+      return roots;
   }
 
   /**
@@ -242,17 +311,34 @@ class EvaVM {
    * Spawns a potential GC cycle.
    */
   void maybeGC() {
-    if (Traceable::bytesAllocated < GC_TRESHOLD) {
+    if (Traceable::heap->bytesAllocated < GC_TRESHOLD) {
         return;
     }
+    // The pause covers the whole stop: roots, verification and the cycle
+    auto start = std::chrono::steady_clock::now();
     auto roots = getGCRoots();
     if (roots.size() == 0) {
         return;
     }
-    std::cout << "---------- Before GC stats ----------\n";
+#ifdef EVA_VERIFY_HEAP
+    collector->verify(roots);
+#endif
+    TRACE(tracer, TRACE_GC, TraceLevel::INFO) << "---------- Before GC stats ----------\n";
+    auto bytesBefore = Traceable::heap->bytesAllocated;
     collector->gc(roots);
-    std::cout << "---------- After GC stats ----------\n";
-    Traceable::printStats();
+#ifdef EVA_VERIFY_HEAP
+    collector->verify(roots);
+#endif
+    auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    gcStats.recordCycle(pause.count(), bytesBefore, Traceable::heap->bytesAllocated);
+    TRACE(tracer, TRACE_GC, TraceLevel::VERBOSE)
+        << "GC pause: " << pause.count() << " ns, roots: " << roots.size()
+        << ", freed: " << gcStats.lastBytesFreed << " bytes\n";
+    if (tracer.enabled(TRACE_GC, TraceLevel::INFO)) {
+        tracer.out() << "---------- After GC stats ----------\n";
+        Traceable::printStats(tracer.out());
+    }
   }
 
   //----------------------------------------------------
@@ -261,29 +347,291 @@ class EvaVM {
   /**
    * Executes a program.
    */
-  EvaValue exec(const std::string& program) {
-    // 1. Parse the program
-    auto ast = parser->parse("(begin " + program + ")");
+  EvaValue exec(std::string_view program) {
+    HeapScope scope(&heap);
+
+    // 1. Parse the program (the previous AST is freed)
+    auto ast = parser->parse(program);
 
     // 2. Compile program to Eva bytecode
-    compiler->compile(ast);
+    compiler->compile(*ast);
+
+    // Debug disassembly:
+    if (tracer.enabled(TRACE_DISASM, TraceLevel::INFO)) {
+        compiler->disassembleBytecode();
+    }
+
+    return runMain();
+  }
+
+  /**
+   * Compiles a program for repeated runs. The parameters are
+   * globals of the program, set by each run to its arguments.
+   */
+  Program compile(std::string_view source,
+                  const std::vector<std::string>& params = {}) {
+    HeapScope scope(&heap);
+    std::vector<int> paramIndices;
+    for (const auto& param : params) {
+        global->define(param);
+        paramIndices.push_back(global->getGlobalIndex(param));
+    }
+    auto ast = parser->parse(source);
+    compiler->compile(*ast);
+    if (tracer.enabled(TRACE_DISASM, TraceLevel::INFO)) {
+        compiler->disassembleBytecode();
+    }
+    return Program(compiler->getMainFunction(), std::move(paramIndices), programRoots);
+  }
+
+  /**
+   * Runs a compiled program with the arguments (EvaValues).
+   */
+  template <typename... Args>
+    requires(std::is_convertible_v<Args, EvaValue> && ...)
+  EvaValue run(const Program& program, const Args&... args) {
+    std::array<EvaValue, sizeof...(Args)> values{args...};
+    return run(program, std::span<const EvaValue>(values));
+  }
+
+  /**
+   * Runs a compiled program: sets its parameters, and runs
+   * the main function on a reset stack.
+   */
+  EvaValue run(const Program& program, std::span<const EvaValue> args) {
+    HeapScope scope(&heap);
+    if (!program.valid() || program.state_->roots.lock() != programRoots) {
+        DIE << "[EvaVM]: run: the program is not compiled by this VM";
+    }
+    auto& params = program.state_->params;
+    if (args.size() != params.size()) {
+        DIE << "[EvaVM]: run: the program expects " << params.size()
+            << " arguments, got " << args.size();
+    }
+    for (size_t i = 0; i < args.size(); i++) {
+        global->set(params[i], args[i]);
+    }
+    compiler->setMainFunction(program.state_->main);
+    return runMain();
+  }
+
+  /**
+   * Executes a program using the bytecode cache file.
+   *
+   * The cached code is loaded if it was compiled from the same
+   * source, otherwise the program is compiled and the cache is written.
+   */
+  EvaValue execCached(std::string_view program, const std::string& cacheFile) {
+    HeapScope scope(&heap);
+    auto sourceHash = BytecodeCache::hashSource(program);
+    auto main = cache->load(cacheFile, sourceHash);
+    if (main != nullptr) {
+        compiler->setMainFunction(main);
+        return runMain();
+    }
+    auto ast = parser->parse(program);
+    compiler->compile(*ast);
+    cache->write(cacheFile, sourceHash, compiler->getMainFunction());
+    if (tracer.enabled(TRACE_DISASM, TraceLevel::INFO)) {
+        compiler->disassembleBytecode();
+    }
+    return runMain();
+  }
+
+  /**
+   * Saves the heap reachable from the globals (after the prelude
+   * has run) to the snapshot file.
+   */
+  bool saveSnapshot(const std::string& fileName) {
+    HeapScope scope(&heap);
+    return snapshot->save(fileName);
+  }
+
+  /**
+   * Restores globals and the heap from the snapshot file, instead
+   * of re-running the prelude.
+   */
+  bool restoreSnapshot(const std::string& fileName) {
+    HeapScope scope(&heap);
+    return snapshot->restore(fileName);
+  }
+
+  /**
+   * Runs the main function of the compiled program.
+   */
+  EvaValue runMain() {
+    enterRootFiber();
 
     // Start from the main entry point:
     fn = compiler->getMainFunction();
 
     // Set instruction pointer to the beginning:
-    ip = &fn->co->code[0];
+    ip = fn->co->getCode();
+
+    // Runtime errors report the executing frames
+    ErrorContext errorContext([this]() { return stackTrace(); });
+
+    DepthScope evalScope(evalDepth);
+    auto result = eval();
+#ifdef EVA_PROFILE
+    profiler.stop();
+#endif
+    return result;
+  }
+
+  /**
+   * Calls the function from the host (or from a native) with the
+   * arguments, and returns its result.
+   *
+   * The callee runs on the stack of the running fiber (the root
+   * fiber outside of a run) above a sentinel frame, on which
+   * OP_RETURN returns from this nested eval. Nothing is allocated
+   * per call. Fibers can't switch until the call returns.
+   */
+  EvaValue call(FunctionObject* callee, std::span<const EvaValue> args) {
+    HeapScope scope(&heap);
+    if (callee->co->isAsync) {
+        DIE << "[EvaVM]: call: async function " << callee->co->name
+            << " can't be called from the host";
+    }
+    if (args.size() != callee->co->arity) {
+        DIE << "[EvaVM]: call: " << callee->co->name << " expects "
+            << callee->co->arity << " arguments, got " << args.size();
+    }
+    auto isNested = evalDepth > 0;
+    if (!isNested) {
+        enterRootFiber();
+    }
+
+    // Registers of the interrupted code
+    auto callerIp = ip;
+    auto callerBp = bp;
+    auto callerFn = fn;
+    auto base = sp;
+
+    // The function and the arguments, as OP_CALL leaves them
+    push(OBJECT((Object*)callee));
+    for (const auto& arg : args) {
+        push(arg);
+    }
+    callStack.push_back(Frame{nullptr, bp, nullptr});
+    fn = callee;
+    fn->cells.resize(fn->co->freeCount);
+    bp = base;
+    ip = fn->co->getCode();
+
+    ErrorContext errorContext([this]() { return stackTrace(); });
+
+    EvaValue result;
+    {
+        DepthScope evalScope(evalDepth);
+        DepthScope callScope(hostCallDepth);
+        result = eval();
+    }
+
+    ip = callerIp;
+    bp = callerBp;
+    fn = callerFn;
+    sp = base;
+    if (!isNested) {
+        finishFiber(result);
+#ifdef EVA_PROFILE
+        profiler.stop();
+#endif
+    }
+    return result;
+  }
+
+  /**
+   * Calls the function stored in the global. The index (from
+   * Global::getGlobalIndex) can be cached by the host: calls see
+   * reassignments, and a replaced function isn't kept alive.
+   */
+  EvaValue call(int globalIndex, std::span<const EvaValue> args) {
+    if (globalIndex < 0 || (size_t)globalIndex >= global->globals.size()) {
+        DIE << "[EvaVM]: call: invalid global index " << globalIndex;
+    }
+    auto& globalVar = global->get(globalIndex);
+    if (!IS_FUNCTION(globalVar.value)) {
+        DIE << "[EvaVM]: call: " << globalVar.name << " is not a function";
+    }
+    return call(AS_FUNCTION(globalVar.value), args);
+  }
+
+  /**
+   * Calls the function (or the function in the global) with
+   * the arguments (EvaValues).
+   */
+  template <typename Callee, typename... Args>
+    requires(std::is_convertible_v<Args, EvaValue> && ...)
+  EvaValue call(Callee callee, const Args&... args) {
+    std::array<EvaValue, sizeof...(Args)> values{args...};
+    return call(callee, std::span<const EvaValue>(values));
+  }
+
+  /**
+   * Binds a C++ function (known at compile time) as a global native:
+   *
+   *   double hypot2(double x, double y) { return x * x + y * y; }
+   *   vm.bind<&hypot2>("hypot2");
+   *
+   * The arity and the argument conversions are derived from the
+   * function type, the native calls the function directly.
+   */
+  template <auto Fn>
+  void bind(const std::string& name) {
+    addBoundNative(name, &StaticNative<Fn>::invoke,
+                   NativeBinding<decltype(Fn)>::arity, nullptr);
+  }
+
+  /**
+   * Binds a C++ function pointer as a global native:
+   *
+   *   vm.bind("lerp", +[](double a, double b, double t) { return a + (b - a) * t; });
+   */
+  template <typename R, typename... Args>
+  void bind(const std::string& name, R (*fn)(Args...)) {
+    using Fn = R (*)(Args...);
+    addBoundNative(name, &DynamicNative<Fn>::invoke, NativeBinding<Fn>::arity,
+                   reinterpret_cast<void (*)()>(fn));
+  }
+
+  /**
+   * Adds a bound native (names of the natives are unique).
+   */
+  void addBoundNative(const std::string& name, NativeFn function, size_t arity,
+                      void (*target)()) {
+    HeapScope scope(&heap);
+    if (global->exists(name)) {
+        DIE << "[EvaVM]: bind: global " << name << " is already defined";
+    }
+    global->addNativeFunction(name, function, arity);
+    AS_NATIVE(global->get(global->getGlobalIndex(name)).value)->target = target;
+  }
+
+  /**
+   * Resets the scheduler, and enters the root fiber with empty
+   * stacks. The root fiber is reused once done (it's a GC root on
+   * its own), the fibers left waiting by the previous run are dropped.
+   */
+  void enterRootFiber() {
+    if (rootFiber == nullptr || rootFiber->state != FiberState::DONE) {
+        rootFiber = AS_FIBER(ALLOC_FIBER(STACK_LIMIT));
+    }
+    rootFiber->state = FiberState::RUNNING;
+    rootFiber->result = EvaValue{};
+    rootFiber->callStack.clear();
+    fiber = rootFiber;
+    liveFibers.clear();
+    readyFibers.clear();
+    callStack.clear();
 
     // Init the stack:
-    sp = &stack[0];
+    stack = fiber->stack.data();
+    sp = stack;
 
     // Init the base (frame) pointer:
     bp = sp;
-
-    // Debug disassembly:
-    compiler->disassembleBytecode();
-
-    return eval();
   }
 
   /**
@@ -292,13 +640,25 @@ class EvaVM {
   EvaValue eval() {
     for (;;) {
         // dumpStack();
+#ifdef EVA_PROFILE
+        profiler.enter(fn->co, ip - fn->co->getCode(), *ip);
+#endif
+        if (sampler.pending) {
+            sampler.sample(fn, ip, callStack);
+        }
         auto opcode = READ_BYTE();
         switch (opcode) {
-            case OP_HALT;
-                return pop();
-            case OP_CONST;
+            // End of the main program, the spawned fibers keep running
+            case OP_HALT: {
+                finishFiber(pop());
+                if (!switchFiber()) {
+                    return rootFiber->result;
+                }
+                break;
+            }
+            case OP_CONST:
                 push(GET_CONST());
-                break();
+                break;
             case OP_ADD: {
                 //BINARY_OP(+);
                 auto op2 = pop();
@@ -340,8 +700,19 @@ class EvaVM {
                 } else if (IS_STRING(op1) && IS_STRING(op2)) {
                     auto s1 = AS_STRING(op1);
                     auto s2 = AS_STRING(op2);
-                    COMPARE_VALUES(op, s1, s2);
+                    COMPARE_VALUES(op, s1->string, s2->string);
+                } else if (op == 2 || op == 5) {
+                    // Other values are equal when they're the same boolean
+                    // or the same object
+                    auto equal = op1.type == op2.type &&
+                        (IS_BOOLEAN(op1) ? AS_BOOLEAN(op1) == AS_BOOLEAN(op2)
+                                         : AS_OBJECT(op1) == AS_OBJECT(op2));
+                    push(BOOLEAN(op == 2 ? equal : !equal));
+                } else {
+                    DIE << "[EvaVM]: Can't compare " << evaValueToTypeString(op1)
+                        << " and " << evaValueToTypeString(op2);
                 }
+                break;
             }
             case OP_JMP_IF_FALSE: {
                 auto cond = AS_BOOLEAN(pop());
@@ -359,13 +730,13 @@ class EvaVM {
             
             // Global variable value
             case OP_GET_GLOBAL: {
-                auto globalIndex = READ_BYTE();
+                auto globalIndex = READ_SHORT();
                 push(global->get(globalIndex).value);
                 break;
             }
             case OP_SET_GLOBAL: {
-                auto globalIndex = READ_BYTE();
-                auto value = pop(0);
+                auto globalIndex = READ_SHORT();
+                auto value = peek(0);
                 global->set(globalIndex, value);
                 break;
             }
@@ -374,9 +745,9 @@ class EvaVM {
                 pop();
                 break;
             // Local variable value
-            case OP_GET_GLOBAL: {
+            case OP_GET_LOCAL: {
                 auto localIndex = READ_BYTE();
-                if (localIndex < 0 || localIndex >= stack.size()) {
+                if (localIndex < 0 || localIndex >= STACK_LIMIT) {
                     DIE << "OP_GET_LOCAL: invalid variable index: " << (int)localIndex;
                 }
                 push(bp[localIndex]);
@@ -385,12 +756,25 @@ class EvaVM {
             case OP_SET_LOCAL: {
                 auto localIndex = READ_BYTE();
                 auto value = peek(0);
-                if (localIndex < 0 || localIndex >= stack.size()) {
+                if (localIndex < 0 || localIndex >= STACK_LIMIT) {
                     DIE << "OP_GET_LOCAL: invalid variable index: " << (int)localIndex;
                 }
                 bp[localIndex] = value;
                 break;
             }
+            // Local of an enclosing frame (through the frame link)
+            case OP_GET_PARENT_LOCAL: {
+                auto depth = READ_BYTE();
+                auto localIndex = READ_BYTE();
+                push(parentLocal(depth, localIndex, "OP_GET_PARENT_LOCAL"));
+                break;
+            }
+            case OP_SET_PARENT_LOCAL: {
+                auto depth = READ_BYTE();
+                auto localIndex = READ_BYTE();
+                parentLocal(depth, localIndex, "OP_SET_PARENT_LOCAL") = peek(0);
+                break;
+            }
             // Cell value
             case OP_GET_CELL: {
                 auto cellIndex = READ_BYTE();
@@ -441,18 +825,40 @@ class EvaVM {
                 auto fnValue = peek(argsCount);
                 // 1. Native function
                 if (IS_NATIVE(fnValue)) {
-                    AS_NATIVE(fnValue)->function();
-                    auto result = pop();
-                    // Pop args and function
-                    popN(argsCount + 1);
-                    // Put result back on top
-                    push(result);
+                    auto native = AS_NATIVE(fnValue);
+                    if (argsCount != native->arity) {
+                        DIE << "Native " << native->name << " expects "
+                            << native->arity << " arguments, got " << (int)argsCount;
+                    }
+                    TRACE(tracer, TRACE_CALLS, TraceLevel::VERBOSE)
+                        << std::string(callStack.size() * 2, ' ') << "native "
+                        << native->name << "/" << (int)argsCount << "\n";
+                    // Arguments are passed in place on the stack
+                    auto result = native->function(this, sp - argsCount, argsCount);
+                    // Pop args, and put result in place of the function
+                    sp -= argsCount;
+                    *(sp - 1) = result;
+                    // Async native suspended the fiber, the result is pushed on resume
+                    if (fiber->state == FiberState::WAITING) {
+                        sp--;
+                        if (!switchFiber()) {
+                            return rootFiber->result;
+                        }
+                    }
                     break;
                 }
                 // 2. User-defined function:
                 auto callee = AS_FUNCTION(fnValue);
+                // Async function runs in a new fiber, the call returns the fiber
+                if (callee->co->isAsync) {
+                    push(OBJECT((Object*)spawn(argsCount)));
+                    break;
+                }
+                TRACE(tracer, TRACE_CALLS, TraceLevel::VERBOSE)
+                    << std::string(callStack.size() * 2, ' ') << "call "
+                    << callee->co->name << "/" << (int)argsCount << "\n";
                 // Save execution context, restored on OP_RETURN
-                callStack.push(Frame(ip, bp, fn));
+                callStack.push_back(Frame(ip, bp, fn));
                 // To access locals, etc:
                 fn = callee;
                 // Shrink the cells vector to the size of only free vars, since other (own) cells should be
@@ -461,18 +867,30 @@ class EvaVM {
                 // Set the base (frame) pointer for the callee
                 bp = sp - argsCount - 1;
                 // Jump to the function code
-                ip = &callee->co->code[0];
+                ip = callee->co->getCode();
                 break;
             }
             // Return from function
             case OP_RETURN: {
+                // Fiber function is done
+                if (callStack.empty()) {
+                    finishFiber(pop());
+                    if (!switchFiber()) {
+                        return rootFiber->result;
+                    }
+                    break;
+                }
                 //Restore the caller address
-                auto callerFrame = callStack.top();
+                auto callerFrame = callStack.back();
+                callStack.pop_back();
+                // Back to the host (sentinel frame of a call)
+                if (callerFrame.ra == nullptr) {
+                    return pop();
+                }
                 // Restore ip, bp and fn for caller
                 ip = callerFrame.ra;
                 bp = callerFrame.bp;
                 fn = callerFrame.fn;
-                callStack.pop();
                 break;
             }
             // Create instance
@@ -510,6 +928,159 @@ class EvaVM {
                 push(instance->properties[prop] = value);
                 break;
             }
+            // Array literal
+            case OP_ARRAY_NEW: {
+                auto count = READ_BYTE();
+                // Elements stay on the stack (GC roots) during allocation
+                auto arrayValue = MEM(ALLOC_ARRAY);
+                auto array = AS_ARRAY(arrayValue);
+                array->reserve(count);
+                for (auto element = sp - count; element < sp; element++) {
+                    array->push(*element);
+                }
+                popN(count);
+                push(arrayValue);
+                break;
+            }
+            // Array element
+            case OP_INDEX_GET: {
+                auto index = pop();
+                auto object = pop();
+                if (IS_FLOAT64_ARRAY(object)) {
+                    auto& data = AS_FLOAT64_ARRAY(object)->data;
+                    push(NUMBER(data[toIndex(data.size(), index)]));
+                } else if (IS_MAP(object)) {
+                    auto value = AS_MAP(object)->get(toKey(index));
+                    if (value == nullptr) {
+                        DIE << "[EvaVM]: Key " << evaValueToConstantString(index)
+                            << " is not in the map";
+                    }
+                    push(*value);
+                } else {
+                    auto& elements = toArray(object, "OP_INDEX_GET")->elements;
+                    push(elements[toIndex(elements.size(), index)]);
+                }
+                break;
+            }
+            case OP_INDEX_SET: {
+                auto index = pop();
+                auto object = pop();
+                auto value = pop();
+                if (IS_FLOAT64_ARRAY(object)) {
+                    auto& data = AS_FLOAT64_ARRAY(object)->data;
+                    if (!IS_NUMBER(value)) {
+                        DIE << "[EvaVM]: OP_INDEX_SET: Float64Array elements are numbers, got "
+                            << evaValueToTypeString(value);
+                    }
+                    data[toIndex(data.size(), index)] = AS_NUMBER(value);
+                } else if (IS_MAP(object)) {
+                    AS_MAP(object)->set(toKey(index), value);
+                } else {
+                    auto& elements = toArray(object, "OP_INDEX_SET")->elements;
+                    elements[toIndex(elements.size(), index)] = value;
+                }
+                push(value);
+                break;
+            }
+            // Map literal
+            case OP_MAP_NEW: {
+                auto count = READ_BYTE();
+                auto mapValue = MEM(ALLOC_MAP);
+                auto map = AS_MAP(mapValue);
+                for (auto entry = sp - 2 * count; entry < sp; entry += 2) {
+                    map->set(toKey(entry[0]), entry[1]);
+                }
+                popN(2 * count);
+                push(mapValue);
+                break;
+            }
+            case OP_MAP_HAS: {
+                auto key = pop();
+                auto map = toMap(pop(), "OP_MAP_HAS");
+                push(BOOLEAN(map->has(toKey(key))));
+                break;
+            }
+            case OP_MAP_DELETE: {
+                auto key = pop();
+                auto map = toMap(pop(), "OP_MAP_DELETE");
+                push(BOOLEAN(map->remove(toKey(key))));
+                break;
+            }
+            // Map iteration (cursors are slot indices, -1 is before the start / at the end)
+            case OP_MAP_NEXT: {
+                auto cursor = pop();
+                auto map = toMap(pop(), "OP_MAP_NEXT");
+                if (!IS_NUMBER(cursor)) {
+                    DIE << "[EvaVM]: OP_MAP_NEXT: invalid cursor " << cursor;
+                }
+                push(NUMBER(map->next((int64_t)AS_NUMBER(cursor))));
+                break;
+            }
+            case OP_MAP_KEY:
+            case OP_MAP_VALUE: {
+                auto cursor = pop();
+                auto map = toMap(pop(), opcode == OP_MAP_KEY ? "OP_MAP_KEY" : "OP_MAP_VALUE");
+                auto& entry = map->entries[toIndex(map->entries.size(), cursor)];
+                if (entry.distance < 0) {
+                    DIE << "[EvaVM]: No map entry at cursor " << cursor;
+                }
+                push(opcode == OP_MAP_KEY ? entry.key : entry.value);
+                break;
+            }
+            // Array or string length
+            case OP_LEN: {
+                auto object = pop();
+                if (IS_ARRAY(object)) {
+                    push(NUMBER(AS_ARRAY(object)->elements.size()));
+                } else if (IS_FLOAT64_ARRAY(object)) {
+                    push(NUMBER(AS_FLOAT64_ARRAY(object)->data.size()));
+                } else if (IS_MAP(object)) {
+                    push(NUMBER(AS_MAP(object)->count));
+                } else if (IS_STRING(object)) {
+                    push(NUMBER(AS_CPPSTRING(object).size()));
+                } else {
+                    DIE << "[EvaVM]: OP_LEN: expected an array, a map or a string, got "
+                        << evaValueToTypeString(object);
+                }
+                break;
+            }
+            // Call in a new fiber
+            case OP_SPAWN: {
+                auto argsCount = READ_BYTE();
+                push(OBJECT((Object*)spawn(argsCount)));
+                break;
+            }
+            // Suspends the fiber until the awaited one is done
+            case OP_AWAIT: {
+                auto value = pop();
+                // Other values are ready results
+                if (!IS_FIBER(value)) {
+                    push(value);
+                    break;
+                }
+                auto target = AS_FIBER(value);
+                if (target->state == FiberState::DONE) {
+                    push(target->result);
+                    break;
+                }
+                if (target == fiber) {
+                    DIE << "[EvaVM]: A fiber can't await itself";
+                }
+                // The result is pushed when the target is done
+                fiber->state = FiberState::WAITING;
+                target->waiters.push_back(fiber);
+                if (!switchFiber()) {
+                    return rootFiber->result;
+                }
+                break;
+            }
+            // Lets other ready fibers run
+            case OP_YIELD: {
+                push(BOOLEAN(true));
+                schedule(fiber);
+                switchFiber();
+                break;
+            }
             default:
                 DIE << "Unkown Opcode: " << std::hex << opcode;
       }
@@ -520,27 +1091,261 @@ class EvaVM {
    * Sets up global variables and function.
    */
   void setGlobalVariables() {
-      // Native square function
-      global->addNativeFunction(
-          "native-square",
-          [&]() {
-              auto x = AS_NUMBER(peek(0));
-              push(NUMBER(x * x));
-          },
-          1);
-      // Native sum function
-      global->addNativeFunction(
-          "sum",
-          [&]() {
-              auto v2 = AS_NUMBER(peek(0));
-              auto v1 = AS_NUMBER(peek(1));
-              push(NUMBER(v1 + v2));
-          },
-          2);
+      static const NativeDef natives[] = {
+          // Native square function
+          {"native-square",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto x = vm->toNumber(args[0], "native-square");
+               return NUMBER(x * x);
+           },
+           1},
+          // Native sum function
+          {"sum",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto v1 = vm->toNumber(args[0], "sum");
+               auto v2 = vm->toNumber(args[1], "sum");
+               return NUMBER(v1 + v2);
+           },
+           2},
+          // Appends to an array, returns the new length: (push arr 42)
+          {"push",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto array = vm->toArray(args[0], "push");
+               array->push(args[1]);
+               return NUMBER(array->elements.size());
+           },
+           2},
+          // Calls the function with the array elements through the host
+          // call API: (apply square (array 3))
+          {"apply",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               if (!IS_FUNCTION(args[0])) {
+                   DIE << "[EvaVM]: apply: expected a function, got "
+                       << evaValueToTypeString(args[0]);
+               }
+               // Copied: the callee may modify the array
+               auto callArgs = vm->toArray(args[1], "apply")->elements;
+               return vm->call(AS_FUNCTION(args[0]), std::span<const EvaValue>(callArgs));
+           },
+           2},
+          // Float64Array of zeros: (f64-array 1000000)
+          {"f64-array",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto count = vm->toNumber(args[0], "f64-array");
+               if (!(count >= 0 && count <= FLOAT64_ARRAY_MAX_LENGTH) ||
+                   count != (size_t)count) {
+                   DIE << "[EvaVM]: f64-array: invalid length " << count;
+               }
+               vm->maybeGC();
+               return ALLOC_FLOAT64_ARRAY((size_t)count);
+           },
+           1},
+          // Float64Array from an array of numbers: (f64-from (array 1 2 3))
+          {"f64-from",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto& elements = vm->toArray(args[0], "f64-from")->elements;
+               vm->maybeGC();
+               auto result = ALLOC_FLOAT64_ARRAY(elements.size());
+               auto& data = AS_FLOAT64_ARRAY(result)->data;
+               for (size_t i = 0; i < elements.size(); i++) {
+                   if (!IS_NUMBER(elements[i])) {
+                       DIE << "[EvaVM]: f64-from: element " << i << " is not a number";
+                   }
+                   data[i] = AS_NUMBER(elements[i]);
+               }
+               return result;
+           },
+           1},
+          // Elementwise ops into the destination (which may be a source),
+          // return the destination: (f64-add dst a b)
+          {"f64-add",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto dst = vm->toFloat64Array(args[0], "f64-add");
+               auto a = vm->toFloat64Array(args[1], "f64-add");
+               auto b = vm->toFloat64Array(args[2], "f64-add");
+               float64::add(dst->data.data(), a->data.data(), b->data.data(),
+                            vm->sameLength("f64-add", {dst, a, b}));
+               return args[0];
+           },
+           3},
+          {"f64-mul",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto dst = vm->toFloat64Array(args[0], "f64-mul");
+               auto a = vm->toFloat64Array(args[1], "f64-mul");
+               auto b = vm->toFloat64Array(args[2], "f64-mul");
+               float64::mul(dst->data.data(), a->data.data(), b->data.data(),
+                            vm->sameLength("f64-mul", {dst, a, b}));
+               return args[0];
+           },
+           3},
+          // dst = a * b + c: (f64-fma dst a b c)
+          {"f64-fma",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto dst = vm->toFloat64Array(args[0], "f64-fma");
+               auto a = vm->toFloat64Array(args[1], "f64-fma");
+               auto b = vm->toFloat64Array(args[2], "f64-fma");
+               auto c = vm->toFloat64Array(args[3], "f64-fma");
+               float64::fma(dst->data.data(), a->data.data(), b->data.data(),
+                            c->data.data(), vm->sameLength("f64-fma", {dst, a, b, c}));
+               return args[0];
+           },
+           4},
+          // dst = a * k: (f64-scale dst a 0.5)
+          {"f64-scale",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto dst = vm->toFloat64Array(args[0], "f64-scale");
+               auto a = vm->toFloat64Array(args[1], "f64-scale");
+               float64::scale(dst->data.data(), a->data.data(), vm->toNumber(args[2], "f64-scale"),
+                              vm->sameLength("f64-scale", {dst, a}));
+               return args[0];
+           },
+           3},
+          // Reductions: (f64-sum a), (f64-dot a b), (f64-min a), (f64-max a)
+          {"f64-sum",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto& data = vm->toFloat64Array(args[0], "f64-sum")->data;
+               return NUMBER(float64::sum(data.data(), data.size()));
+           },
+           1},
+          {"f64-dot",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto a = vm->toFloat64Array(args[0], "f64-dot");
+               auto b = vm->toFloat64Array(args[1], "f64-dot");
+               return NUMBER(float64::dot(a->data.data(), b->data.data(),
+                                          vm->sameLength("f64-dot", {a, b})));
+           },
+           2},
+          {"f64-min",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto& data = vm->toFloat64Array(args[0], "f64-min")->data;
+               return NUMBER(float64::min(data.data(), data.size()));
+           },
+           1},
+          {"f64-max",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto& data = vm->toFloat64Array(args[0], "f64-max")->data;
+               return NUMBER(float64::max(data.data(), data.size()));
+           },
+           1},
+          // Async I/O: the calling fiber waits, the others keep running.
+          // File contents: (read-file "data.txt")
+          {"read-file",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               vm->events.readFile(vm->fiber, vm->toCppString(args[0], "read-file"));
+               return vm->suspend();
+           },
+           1},
+          // Writes the file, returns the number of bytes: (write-file "out.txt" data)
+          {"write-file",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               vm->events.writeFile(vm->fiber, vm->toCppString(args[0], "write-file"),
+                                    vm->toCppString(args[1], "write-file"));
+               return vm->suspend();
+           },
+           2},
+          // Timer, returns true: (sleep 100)
+          {"sleep",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               vm->events.sleep(vm->fiber, vm->toNumber(args[0], "sleep"));
+               return vm->suspend();
+           },
+           1},
+          // Pipe and connected local sockets: (array <fd> <fd>)
+          {"pipe",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               return vm->fdPair(vm->events.pipe());
+           },
+           0},
+          {"socket-pair",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               return vm->fdPair(vm->events.socketPair());
+           },
+           0},
+          // Available data, "" at the end: (fd-read fd)
+          {"fd-read",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               std::string data;
+               if (!vm->events.read(vm->fiber, vm->toFd(args[0], "fd-read"), data)) {
+                   return vm->suspend();
+               }
+               vm->maybeGC();
+               return ALLOC_STRING(data);
+           },
+           1},
+          // Writes all the data, returns the number of bytes: (fd-write fd "ping")
+          {"fd-write",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto& data = vm->toCppString(args[1], "fd-write");
+               if (!vm->events.write(vm->fiber, vm->toFd(args[0], "fd-write"), data)) {
+                   return vm->suspend();
+               }
+               return NUMBER(data.size());
+           },
+           2},
+          {"fd-close",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               vm->events.close(vm->toFd(args[0], "fd-close"));
+               return BOOLEAN(true);
+           },
+           1},
+          // Channel shared by the isolates: (channel "jobs" 64)
+          {"channel",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto& name = vm->toCppString(args[0], "channel");
+               auto capacity = vm->toNumber(args[1], "channel");
+               if (!(capacity >= 1 && capacity <= CHANNEL_MAX_CAPACITY)) {
+                   DIE << "[EvaVM]: channel: invalid capacity " << capacity;
+               }
+               vm->maybeGC();
+               return ALLOC_CHANNEL(Channel::open(name, (size_t)capacity));
+           },
+           2},
+          // Sends a clone of the value (waits while full), returns true: (send ch v)
+          {"send",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto channel = vm->toChannel(args[0], "send");
+               ChannelMessage message;
+               vm->codec.encode(args[1], message);
+               if (!vm->events.send(vm->fiber, channel->channel, message)) {
+                   return vm->suspend();
+               }
+               return BOOLEAN(true);
+           },
+           2},
+          // Next message (waits while empty): (receive ch)
+          {"receive",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto channel = vm->toChannel(args[0], "receive");
+               ChannelMessage message;
+               if (!vm->events.receive(vm->fiber, channel->channel, message)) {
+                   return vm->suspend();
+               }
+               return vm->receiveMessage(message);
+           },
+           1},
+          // GC stats by name: (gc-stat "pause.p99")
+          {"gc-stat",
+           [](EvaVM* vm, EvaValue* args, size_t argc) {
+               auto& name = vm->toCppString(args[0], "gc-stat");
+               return NUMBER(vm->gcStats.get(name));
+           },
+           1},
+      };
+      global->addNativeFunctions(natives, std::size(natives));
       // Global variable
       global->addConst("VERSION", 1);
   }
 
+  /**
+   * Isolate heap: all objects of this VM.
+   */
+  Heap heap;
+
+  /**
+   * Trace output (before the components writing to it).
+   */
+  Tracer tracer;
+
   /**
    * Global object.
    */
@@ -561,6 +1366,31 @@ class EvaVM {
    */
   std::unique_ptr<EvaCollector> collector;
 
+  /**
+   * Bytecode cache.
+   */
+  std::unique_ptr<BytecodeCache> cache;
+
+  /**
+   * Heap snapshot.
+   */
+  std::unique_ptr<HeapSnapshot> snapshot;
+
+  /**
+   * GC telemetry.
+   */
+  GCStats gcStats;
+
+  /**
+   * Sampling profiler (started by the host).
+   */
+  SamplingProfiler sampler;
+
+  /**
+   * Main functions of the compiled programs with live handles.
+   */
+  std::shared_ptr<ProgramRoots> programRoots = std::make_shared<ProgramRoots>();
+
   /**
    * Instruction pointer (aka Program counter).
    */
@@ -577,20 +1407,381 @@ class EvaVM {
   EvaValue* bp;
 
   /**
-   * Operands stack.
+   * Operands stack (of the running fiber).
    */
-  std::array<EvaValue, STACK_LIMIT> stack;
+  EvaValue* stack;
 
   /**
    * Separate stack for calls. Keeps return addresses.
+   *
+   * Indexable, since non-escaping functions walk up the
+   * frames to reach the locals of the enclosing functions.
    */
-  std::stack<Frame> callStack;
+  std::vector<Frame> callStack;
 
   /**
    * Currently executing function.
    */
   FunctionObject* fn;
 
+  /**
+   * Running fiber, and the fiber of the main program.
+   */
+  FiberObject* fiber = nullptr;
+  FiberObject* rootFiber = nullptr;
+
+  /**
+   * Scheduler: fibers ready to run (FIFO), and all
+   * the fibers which are not done yet.
+   */
+  std::deque<FiberObject*> readyFibers;
+  std::unordered_set<FiberObject*> liveFibers;
+
+  /**
+   * Nesting of the eval loop (runs and calls), and of the calls.
+   */
+  size_t evalDepth = 0;
+  size_t hostCallDepth = 0;
+
+  /**
+   * Event loop of the async natives.
+   */
+  EventLoop events;
+
+  /**
+   * Structured clone of the channel messages.
+   */
+  MessageCodec codec;
+
+#ifdef EVA_PROFILE
+  /**
+   * Opcode profiler.
+   */
+  OpcodeProfiler profiler;
+#endif
+
+  /**
+   * Source positions of the running function and its callers.
+   */
+  std::string stackTrace() {
+      std::string trace = "    at " + sourcePosition(fn, ip);
+      for (auto frame = callStack.rbegin(); frame != callStack.rend(); frame++) {
+          if (frame->fn != nullptr) {
+              trace += "\n    at " + sourcePosition(frame->fn, frame->ra);
+          }
+      }
+      return trace;
+  }
+
+  /**
+   * Function name and line of the instruction before the address
+   * (the address is past the executing opcode, or the return address).
+   */
+  static std::string sourcePosition(FunctionObject* fn, uint8_t* address) {
+      auto offset = address - fn->co->getCode();
+      return fn->co->name + ":" +
+             std::to_string(fn->co->getLine(offset > 0 ? offset - 1 : 0));
+  }
+
+  //----------------------------------------------------
+  // Fibers:
+
+  /**
+   * Spawns a fiber calling the function with the arguments
+   * on top of the stack (popped), and schedules it.
+   */
+  FiberObject* spawn(size_t argsCount) {
+      // Function and arguments stay on the stack (GC roots) during allocation
+      auto newFiber = AS_FIBER(MEM(ALLOC_FIBER, STACK_LIMIT));
+      auto fnValue = peek(argsCount);
+      if (!IS_FUNCTION(fnValue)) {
+          DIE << "[EvaVM]: spawn: expected a function, got "
+              << evaValueToTypeString(fnValue);
+      }
+      auto callee = AS_FUNCTION(fnValue);
+      // The callee frame is at the bottom of the fiber stack
+      std::copy(sp - argsCount - 1, sp, newFiber->stack.begin());
+      newFiber->sp = newFiber->bp + argsCount + 1;
+      newFiber->fn = callee;
+      newFiber->ip = callee->co->getCode();
+      callee->cells.resize(callee->co->freeCount);
+      popN(argsCount + 1);
+      liveFibers.insert(newFiber);
+      schedule(newFiber);
+      return newFiber;
+  }
+
+  /**
+   * Appends the fiber to the ready queue.
+   */
+  void schedule(FiberObject* readyFiber) {
+      readyFiber->state = FiberState::READY;
+      readyFibers.push_back(readyFiber);
+  }
+
+  /**
+   * Completes the running fiber, and resumes the waiters
+   * with the result.
+   */
+  void finishFiber(const EvaValue& result) {
+      fiber->state = FiberState::DONE;
+      fiber->result = result;
+      liveFibers.erase(fiber);
+      for (auto waiter : fiber->waiters) {
+          resume(waiter, result);
+      }
+      fiber->waiters.clear();
+  }
+
+  /**
+   * Suspends the running fiber from an async native (the
+   * returned value is a placeholder, see resume).
+   */
+  EvaValue suspend() {
+      fiber->state = FiberState::WAITING;
+      return BOOLEAN(false);
+  }
+
+  /**
+   * Schedules the waiting fiber with the result of the
+   * awaited fiber or native call.
+   */
+  void resume(FiberObject* waiter, const EvaValue& result) {
+      *waiter->sp++ = result;
+      schedule(waiter);
+  }
+
+  /**
+   * Decodes the received message into this isolate's heap.
+   */
+  EvaValue receiveMessage(ChannelMessage& message) {
+      maybeGC();
+      return codec.decode(message);
+  }
+
+  /**
+   * Resumes the fibers of the completed I/O operations.
+   */
+  void pollEvents(int timeoutMs) {
+      for (auto& completion : events.poll(timeoutMs)) {
+          if (!completion.error.empty()) {
+              DIE << "[EvaVM]: " << completion.error;
+          }
+          switch (completion.type) {
+              case IoResultType::STRING:
+                  resume(completion.fiber, MEM(ALLOC_STRING, completion.data));
+                  break;
+              case IoResultType::NUMBER:
+                  resume(completion.fiber, NUMBER(completion.number));
+                  break;
+              case IoResultType::NONE:
+                  resume(completion.fiber, BOOLEAN(true));
+                  break;
+              case IoResultType::MESSAGE:
+                  resume(completion.fiber, receiveMessage(completion.message));
+                  break;
+          }
+      }
+  }
+
+  /**
+   * Switches to the next ready fiber after the running one is
+   * done or suspended. Returns false once the main program is
+   * done, no fiber is ready, and no I/O is pending.
+   */
+  bool switchFiber() {
+      if (hostCallDepth > 0) {
+          DIE << "[EvaVM]: A fiber can't be suspended in a call from the host";
+      }
+      // Save the running context: the completed I/O may resume
+      // this same fiber, pushing the result on its stack
+      saveRegisters();
+      // Completed I/O first, then block for it if nothing else is ready
+      if (events.pending() > 0) {
+          pollEvents(0);
+      }
+      while (readyFibers.empty()) {
+          if (events.pending() > 0) {
+              pollEvents(-1);
+              continue;
+          }
+          if (rootFiber->state == FiberState::DONE) {
+              return false;
+          }
+          DIE << "[EvaVM]: Deadlock: all fibers are waiting";
+      }
+      auto next = readyFibers.front();
+      readyFibers.pop_front();
+      // Load the next context
+      callStack.swap(fiber->callStack);
+      fiber = next;
+      callStack.swap(fiber->callStack);
+      fiber->state = FiberState::RUNNING;
+      ip = fiber->ip;
+      sp = fiber->sp;
+      bp = fiber->bp;
+      fn = fiber->fn;
+      stack = fiber->stack.data();
+      return true;
+  }
+
+  /**
+   * Saves the registers into the running fiber.
+   */
+  void saveRegisters() {
+      fiber->ip = ip;
+      fiber->sp = sp;
+      fiber->bp = bp;
+      fiber->fn = fn;
+  }
+
+  /**
+   * Local of the enclosing frame at the depth. The frames up to it
+   * are direct calls: a sentinel frame of a host call (null fn) has
+   * no enclosing locals.
+   */
+  EvaValue& parentLocal(size_t depth, size_t localIndex, const char* op) {
+      if (depth == 0 || depth > callStack.size()) {
+          DIE << "[EvaVM]: " << op << ": invalid frame depth " << depth;
+      }
+      for (size_t i = 1; i <= depth; i++) {
+          if (callStack[callStack.size() - i].fn == nullptr) {
+              DIE << "[EvaVM]: " << op << ": frame at depth " << depth
+                  << " is outside of the host call";
+          }
+      }
+      auto parentBp = callStack[callStack.size() - depth].bp;
+      if (parentBp + localIndex >= bp) {
+          DIE << "[EvaVM]: " << op << ": invalid variable index " << localIndex;
+      }
+      return parentBp[localIndex];
+  }
+
+  /**
+   * Checks the value is an array.
+   */
+  ArrayObject* toArray(const EvaValue& value, const char* op) {
+      if (!IS_ARRAY(value)) {
+          DIE << "[EvaVM]: " << op << ": expected an array, got "
+              << evaValueToTypeString(value);
+      }
+      return AS_ARRAY(value);
+  }
+
+  /**
+   * Checks the value is a Float64Array.
+   */
+  Float64ArrayObject* toFloat64Array(const EvaValue& value, const char* op) {
+      if (!IS_FLOAT64_ARRAY(value)) {
+          DIE << "[EvaVM]: " << op << ": expected a Float64Array, got "
+              << evaValueToTypeString(value);
+      }
+      return AS_FLOAT64_ARRAY(value);
+  }
+
+  /**
+   * Checks the value is a map.
+   */
+  MapObject* toMap(const EvaValue& value, const char* op) {
+      if (!IS_MAP(value)) {
+          DIE << "[EvaVM]: " << op << ": expected a map, got "
+              << evaValueToTypeString(value);
+      }
+      return AS_MAP(value);
+  }
+
+  /**
+   * Checks the value can be a map key.
+   */
+  const EvaValue& toKey(const EvaValue& key) {
+      if (!MapObject::isValidKey(key)) {
+          DIE << "[EvaVM]: Invalid map key " << evaValueToTypeString(key)
+              << ", expected a number, a string or a boolean";
+      }
+      return key;
+  }
+
+  /**
+   * Checks the Float64Arrays have the same length, returns it.
+   */
+  size_t sameLength(const char* op,
+                    std::initializer_list<Float64ArrayObject*> arrays) {
+      auto count = (*arrays.begin())->data.size();
+      for (auto array : arrays) {
+          if (array->data.size() != count) {
+              DIE << "[EvaVM]: " << op << ": length mismatch "
+                  << array->data.size() << " != " << count;
+          }
+      }
+      return count;
+  }
+
+  /**
+   * Checks the value is a channel.
+   */
+  ChannelObject* toChannel(const EvaValue& value, const char* op) {
+      if (!IS_CHANNEL(value)) {
+          DIE << "[EvaVM]: " << op << ": expected a channel, got "
+              << evaValueToTypeString(value);
+      }
+      return AS_CHANNEL(value);
+  }
+
+  /**
+   * Checks the value is a number.
+   */
+  double toNumber(const EvaValue& value, const char* op) {
+      if (!IS_NUMBER(value)) {
+          DIE << "[EvaVM]: " << op << ": expected a number, got "
+              << evaValueToTypeString(value);
+      }
+      return AS_NUMBER(value);
+  }
+
+  /**
+   * Checks the value is a string.
+   */
+  const std::string& toCppString(const EvaValue& value, const char* op) {
+      if (!IS_STRING(value)) {
+          DIE << "[EvaVM]: " << op << ": expected a string, got "
+              << evaValueToTypeString(value);
+      }
+      return AS_CPPSTRING(value);
+  }
+
+  /**
+   * Checks the value is an fd opened by the event loop.
+   */
+  int toFd(const EvaValue& value, const char* op) {
+      auto fd = toNumber(value, op);
+      if (!(fd >= 0 && fd <= INT_MAX) || fd != (int)fd || !events.owns((int)fd)) {
+          DIE << "[EvaVM]: " << op << ": invalid fd " << fd;
+      }
+      return (int)fd;
+  }
+
+  /**
+   * Array of the two fds.
+   */
+  EvaValue fdPair(std::pair<int, int> fds) {
+      maybeGC();
+      auto pair = ALLOC_ARRAY();
+      AS_ARRAY(pair)->push(NUMBER(fds.first));
+      AS_ARRAY(pair)->push(NUMBER(fds.second));
+      return pair;
+  }
+
+  /**
+   * Converts the index value, checking the array bounds.
+   */
+  size_t toIndex(size_t count, const EvaValue& index) {
+      auto number = toNumber(index, "index");
+      if (!(number >= 0 && number < count) || number != (size_t)number) {
+          DIE << "[EvaVM]: Index " << number << " is out of bounds of array[" << count << "]";
+      }
+      return (size_t)number;
+  }
+
   // --------------------------------------------------
   // Debug functions:
 
@@ -599,11 +1790,11 @@ class EvaVM {
    */
   void dumpStack() {
       std::cout << "\n---------- Stack ----------\n";
-      if (sp == stack.begin()) {
+      if (sp == stack) {
           std::cout << "(empty)";
       }
       auto csp = sp - 1;
-      while (csp >= stack.begin()) {
+      while (csp >= stack) {
           std::cout << *csp-- << "\n";
       }
       std::cout << "\n";
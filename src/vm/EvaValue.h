@@ -15,6 +15,10 @@
 #ifndef EvaValue_h
 #define EvaValue_h
 
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <functional>
 #include <list>
 #include <string>
 #include <vector>
@@ -39,10 +43,44 @@ enum class ObjectType {
   CELL,
   CLASS,
   INSTANCE,
+  ARRAY,
+  FLOAT64_ARRAY,
+  MAP,
+  FIBER,
+  CHANNEL,
 };
 
 // ----------------------------------------------------------------
 
+struct Traceable;
+
+/**
+ * Isolate heap: objects allocated by one VM instance.
+ *
+ * Each VM owns its heap and makes it current on the thread while it
+ * runs, so VMs on different threads never share the allocator state.
+ */
+struct Heap {
+  /**
+   * List of all allocated objects.
+   */
+  std::list<Traceable*> objects;
+
+  /**
+   * Total number of allocated bytes.
+   */
+  size_t bytesAllocated = 0;
+};
+
+/**
+ * Allocation header: precedes each object in its block and keeps the
+ * accounted size, so the allocator never writes the object storage
+ * before the constructor nor reads it after the destructor.
+ */
+struct alignas(std::max_align_t) AllocationHeader {
+  size_t size;
+};
+
 /**
  * Base traceable object.
  */
@@ -50,23 +88,46 @@ struct Traceable {
   /**
    * Whether the object was marked during the trace.
    */
-  bool marked;
+  bool marked = false;
 
   /**
    * Allocated size.
    */
-  size_t size;
+  size_t size() const { return header()->size; }
+
+  /**
+   * Accounts the growth of the storage owned by the object
+   * (e.g. array elements) in its size.
+   */
+  void grow(size_t bytes) {
+      header()->size += bytes;
+      Traceable::heap->bytesAllocated += bytes;
+  }
+
+  /**
+   * Accounts the storage released (or handed over) by the object.
+   */
+  void shrink(size_t bytes) {
+      header()->size -= bytes;
+      Traceable::heap->bytesAllocated -= bytes;
+  }
+
+  /**
+   * Objects are deleted polymorphically by the collector.
+   */
+  virtual ~Traceable() {}
 
   /**
    * Allocator.
    */
   static void* operator new(size_t size) {
     // Allocation a block with the header
-      void* object = ::operator new(size);
-      ((Traceable*)object)->size = size;
+      auto header = (AllocationHeader*)::operator new(sizeof(AllocationHeader) + size);
+      header->size = size;
+      auto object = (Traceable*)(header + 1);
 
-      Traceable::objects.push_back((Traceable*)object);
-      Traceable::bytesAllocated += size;
+      Traceable::heap->objects.push_back(object);
+      Traceable::heap->bytesAllocated += size;
 
       return object;
   }
@@ -75,51 +136,58 @@ struct Traceable {
    * Deallocator.
    */
   static void operator delete(void* object, std::size_t sz) {
-      Traceable::bytesAllocated -= ((Traceable*)object)->size;
-      ::operator delete(object, sz);
-      // Note: remove from Traceable::objects during GC cycle
+      auto header = (AllocationHeader*)object - 1;
+      Traceable::heap->bytesAllocated -= header->size;
+      ::operator delete(header, sizeof(AllocationHeader) + sz);
+      // Note: remove from the heap objects during GC cycle
   }
 
   /**
-   * Clean up for all objects.
+   * Clean up for all objects of the current heap.
    */
   static void cleanup() {
-    for (auto& object : object) {
+    for (auto& object : heap->objects) {
         delete object;
     }
-    objects.clear();
+    heap->objects.clear();
   }
 
   /**
    * Printes memory stats
    */
-  static void printStats() {
-      std::cout << "--------------------\n";
-      std::cout << "Memory stats:\n\n";
-      std::cout << "Object allocated : " << std::dec << Traceable::objects.size() << "\n";
-      std::cout << "Bytes allocated : " << std::dec << Traceable::bytesAllocated << "\n\n";
+  static void printStats(std::ostream& out = std::cout) {
+      out << "--------------------\n";
+      out << "Memory stats:\n\n";
+      out << "Object allocated : " << std::dec << Traceable::heap->objects.size() << "\n";
+      out << "Bytes allocated : " << std::dec << Traceable::heap->bytesAllocated << "\n\n";
   }
 
   /**
-   * Total number of allocated bytes.
+   * Heap of the VM running on this thread.
    */
-  static size_t bytesAllocated;
+  static thread_local Heap* heap;
 
+ private:
   /**
-   * List of all allocated objects.
+   * Header of the block the object lives in.
    */
-  static std::list<Traceable*> objects;
+  AllocationHeader* header() const { return (AllocationHeader*)this - 1; }
 };
 
 /**
- * Total bytes allocated.
+ * Heap of the VM running on this thread.
  */
-size_t Traceable::bytesAllocated{0};
+thread_local Heap* Traceable::heap = nullptr;
 
 /**
- * List of all allocated objects.
+ * Makes the heap current on the thread for the scope
+ * (restores the previous one, so VMs can nest).
  */
-std::list<Traceable*> Traceable::objects{};
+struct HeapScope {
+  HeapScope(Heap* heap) : previous(Traceable::heap) { Traceable::heap = heap; }
+  ~HeapScope() { Traceable::heap = previous; }
+  Heap* previous;
+};
 
 // ----------------------------------------------------------------
 
@@ -144,7 +212,28 @@ struct StringObject : public Object {
 
 // ----------------------------------------------------------------
 
-using NativeFn = std::function<void()>;
+/**
+ * Eva value (tagged union).
+ */
+struct EvaValue {
+  EvaValueType type;
+  union {
+    double number;
+    bool boolean;
+    Object* object;
+  };
+};
+
+// ----------------------------------------------------------------
+
+class EvaVM;
+
+/**
+ * Native function ABI: receives the VM, a pointer to the arguments
+ * on the stack and their count, and returns the result. The slot
+ * below the arguments (args[-1]) holds the called native itself.
+ */
+using NativeFn = EvaValue (*)(EvaVM* vm, EvaValue* args, size_t argc);
 
 /**
  * Native function.
@@ -161,20 +250,8 @@ struct NativeObject : public Object {
   std::string name;
   // Number of parameters
   size_t arity;
-};
-
-// ----------------------------------------------------------------
-
-/**
- * Eva value (tagged union).
- */
-struct EvaValue {
-  EvaValueType type;
-  union {
-    double number;
-    bool boolean;
-    Object* object;
-  };
+  // Bound C++ function called by the native (see NativeBinding.h)
+  void (*target)() = nullptr;
 };
 
 // ----------------------------------------------------------------
@@ -235,6 +312,63 @@ struct InstanceObject : public Object {
 
 // ----------------------------------------------------------------
 
+/**
+ * Array object.
+ *
+ * Elements are stored contiguously. The storage is accounted
+ * in the object size, so growing arrays also trigger the GC.
+ */
+struct ArrayObject : public Object {
+  ArrayObject() : Object(ObjectType::ARRAY) {}
+  // Elements
+  std::vector<EvaValue> elements;
+  // Appends an element (amortized O(1))
+  void push(const EvaValue& value) {
+      auto capacity = elements.capacity();
+      elements.push_back(value);
+      accountStorage(capacity);
+  }
+  // Reserves the storage for the elements
+  void reserve(size_t count) {
+      auto capacity = elements.capacity();
+      elements.reserve(count);
+      accountStorage(capacity);
+  }
+  // Adds the storage growth to the heap size
+  void accountStorage(size_t oldCapacity) {
+      grow((elements.capacity() - oldCapacity) * sizeof(EvaValue));
+  }
+};
+
+// ----------------------------------------------------------------
+
+/**
+ * Longest Float64Array (f64-array), 2 GB of doubles.
+ */
+#define FLOAT64_ARRAY_MAX_LENGTH (1 << 28)
+
+/**
+ * Typed array of raw doubles (Float64Array).
+ *
+ * Numbers are stored unboxed, so the bulk natives run
+ * vectorized kernels over the data (see Float64Kernels.h).
+ */
+struct Float64ArrayObject : public Object {
+  Float64ArrayObject(size_t count) : Object(ObjectType::FLOAT64_ARRAY) {
+      resize(count);
+  }
+  // Elements
+  std::vector<double> data;
+  // Resizes the array (new elements are zeros)
+  void resize(size_t count) {
+      auto capacity = data.capacity();
+      data.resize(count, 0.0);
+      grow((data.capacity() - capacity) * sizeof(double));
+  }
+};
+
+// ----------------------------------------------------------------
+
 struct LocalVar {
     std::string name;
     size_t scopeLevel;
@@ -257,6 +391,9 @@ struct CodeObject : public Object {
     std::vector<EvaValue> constants;
     // Bytecode
     std::vector<uint8_t> code;
+    // Bytecode mapped from a cache file (zero-copy, used instead of `code`)
+    uint8_t* mappedCode = nullptr;
+    size_t mappedCodeSize = 0;
     // Current scope level
     size_t scopeLevel = 0;
     // Local variables and functions
@@ -265,9 +402,85 @@ struct CodeObject : public Object {
     std::vector<std::string> cellNames;
     // Free vars count
     size_t freeCount = 0;
+    // Async function: a call spawns a fiber, and returns it
+    bool isAsync = false;
+    // Source line of the definition, and the line table: runs of
+    // (offset delta u8, line delta i8) pairs, see addLine
+    uint32_t line = 0;
+    std::vector<uint8_t> lineTable;
+    // Last run of the line table (encoder state)
+    size_t lastLineOffset = 0;
+    uint32_t lastLine = 0;
+    // Starts the line table at the definition line
+    void startLines(uint32_t line) {
+        this->line = lastLine = line;
+        lastLineOffset = 0;
+        lineTable.clear();
+    }
+    // Maps the bytecode from the offset on to the line. Deltas out
+    // of the pair range are split: (255, 0) advances the offset only,
+    // (0, +-127) the line only
+    void addLine(size_t offset, uint32_t line) {
+        auto offsetDelta = offset - lastLineOffset;
+        auto lineDelta = (int64_t)line - lastLine;
+        while (offsetDelta > 255) {
+            lineTable.push_back(255);
+            lineTable.push_back(0);
+            offsetDelta -= 255;
+        }
+        while (lineDelta > 127 || lineDelta < -127) {
+            auto step = lineDelta > 0 ? 127 : -127;
+            lineTable.push_back(offsetDelta);
+            lineTable.push_back((uint8_t)(int8_t)step);
+            offsetDelta = 0;
+            lineDelta -= step;
+        }
+        lineTable.push_back(offsetDelta);
+        lineTable.push_back((uint8_t)(int8_t)lineDelta);
+        lastLineOffset = offset;
+        lastLine = line;
+    }
+    // Returns the source line of the instruction at the offset
+    // (a table walk, used by errors and profilers only)
+    uint32_t getLine(size_t offset) {
+        size_t runOffset = 0;
+        int64_t runLine = line;
+        for (size_t i = 0; i + 1 < lineTable.size(); i += 2) {
+            runOffset += lineTable[i];
+            if (runOffset > offset) {
+                break;
+            }
+            runLine += (int8_t)lineTable[i + 1];
+        }
+        return (uint32_t)runLine;
+    }
+    // Returns the bytecode start
+    uint8_t* getCode() {
+        return mappedCode != nullptr ? mappedCode : code.data();
+    }
+    // Returns the bytecode size
+    size_t getCodeSize() {
+        return mappedCode != nullptr ? mappedCodeSize : code.size();
+    }
     // Insert bytecode at needed offset
     void insertAtOffset(int offset, uint8_t byte) {
-        code.insert((offset < 0 ? code.end() : code.begin()) + offset, byte);
+        size_t at = offset < 0 ? code.size() + offset : offset;
+        code.insert(code.begin() + at, byte);
+        // Runs from the inserted byte on move by one
+        if (!lineTable.empty()) {
+            std::vector<std::pair<size_t, uint32_t>> runs;
+            size_t runOffset = 0;
+            int64_t runLine = line;
+            for (size_t i = 0; i + 1 < lineTable.size(); i += 2) {
+                runOffset += lineTable[i];
+                runLine += (int8_t)lineTable[i + 1];
+                runs.push_back({runOffset >= at ? runOffset + 1 : runOffset, runLine});
+            }
+            startLines(line);
+            for (auto& run : runs) {
+                addLine(run.first, run.second);
+            }
+        }
     }
     // Adds a local with current scope level
     void addLocal(const std::string& name) {
@@ -290,11 +503,9 @@ struct CodeObject : public Object {
     }
     // Get cell index
     int getCellIndex(const std::string& name) {
-        if (locals.size() > 0) {
-            for (auto i = (int)cellNames.size() - 1; i >= 0; i--) {
-                if (cellNames[i] == name) {
-                    return i;
-                }
+        for (auto i = (int)cellNames.size() - 1; i >= 0; i--) {
+            if (cellNames[i] == name) {
+                return i;
             }
         }
         return -1;
@@ -326,25 +537,91 @@ struct FunctionObject : public Object {
   std::vector<CellObject*> cells;
 };
 
+// ----------------------------------------------------------------
+
+/**
+ * Stack frame for function calls.
+ */
+struct Frame {
+  // Return address of the caller (ip of the caller)
+  uint8_t* ra;
+  // Base pointer of the caller
+  EvaValue* bp;
+  // Reference to the running function (null in the sentinel
+  // frame of a host call, see EvaVM::call)
+  FunctionObject* fn;
+};
+
+/**
+ * Fiber state.
+ */
+enum class FiberState {
+  READY,
+  RUNNING,
+  WAITING,
+  DONE,
+};
+
+/**
+ * Fiber object: a green thread.
+ *
+ * Each fiber has its own operand and call stacks; the registers
+ * (ip, sp, bp, fn) are saved here while the fiber is not running.
+ * The value of the fiber is a handle to await its result.
+ */
+struct FiberObject : public Object {
+  FiberObject(size_t stackSize) : Object(ObjectType::FIBER), stack(stackSize) {
+      sp = bp = stack.data();
+      grow(stack.capacity() * sizeof(EvaValue));
+  }
+  // Operands stack
+  std::vector<EvaValue> stack;
+  // Call stack
+  std::vector<Frame> callStack;
+  // Saved registers
+  uint8_t* ip = nullptr;
+  EvaValue* sp;
+  EvaValue* bp;
+  FunctionObject* fn = nullptr;
+  // Scheduling state
+  FiberState state = FiberState::READY;
+  // Result of the fiber function (once done)
+  EvaValue result{};
+  // Fibers awaiting the result
+  std::vector<FiberObject*> waiters;
+};
+
 // ----------------------------------------------------------------
 // Constructors:
 
-#define NUMBER(value) ((EvaValue){EvaValueType::NUMBER, .number = value})
-#define BOOLEAN(value) ((EvaValue){EvaValueType::BOOLEAN, .boolean = value})
+#define NUMBER(value) (EvaValue{.type = EvaValueType::NUMBER, .number = (double)(value)})
+#define BOOLEAN(value) (EvaValue{.type = EvaValueType::BOOLEAN, .boolean = (bool)(value)})
+
+#define OBJECT(value) (EvaValue{.type = EvaValueType::OBJECT, .object = value})
+
+#define ALLOC_STRING(value) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new StringObject(value)})
 
-#define ALLOC_STRING(value) ((EvaValue){EvaValueType::OBJECT, .object = (Object*)new StringObhect(value)})
+#define ALLOC_CODE(name, arity) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new CodeObject(name, arity)})
 
-#define ALLOC_CODE(name, arity) ((EvaValue){EvaValueType::OBJECT, .object = (Object*)new CodeObject(name)})
+#define ALLOC_NATIVE(fn, name, arity) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new NativeObject(fn, name, arity)})
 
-#define ALLOC_NATIVE(fn, name, arity) ((EvaValue){EvaValueType::OBJECT, .object = (Object*)new NativeObject(fn, name, arity)})
+#define ALLOC_FUNCTION(co) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new FunctionObject(co)})
 
-#define ALLOC_FUNCTION(co) ((EvaValue){EvaValueType::OBJECT, .object = (Object*)new FunctionObject(co)})
+#define ALLOC_CELL(evaValue) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new CellObject(evaValue)})
 
-#define ALLOC_CELL(evaValue) ((EvaValue){EvaValueType::OBJECT, .object = (Object*)new CellObject(evaValue)})
+#define ALLOC_CLASS(name, superClass) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new ClassObject(name, superClass)})
 
-#define ALLOC_CLASS(name, superClass) ((EvaValue){EvaValueType::OBJECT, .object = (Object*)new ClassObject(name, superClass)})
+#define ALLOC_INSTANCE(cls) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new InstanceObject(cls)})
 
-#define ALLOC_INSTANCE(cls) ((EvaValue){EvaValueType::OBJECT, .object = (Object*)new InstanceObject(cls)})
+#define ALLOC_ARRAY() (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new ArrayObject()})
+
+#define ALLOC_FLOAT64_ARRAY(count) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new Float64ArrayObject(count)})
+
+#define ALLOC_MAP() (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new MapObject()})
+
+#define ALLOC_FIBER(stackSize) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new FiberObject(stackSize)})
+
+#define ALLOC_CHANNEL(channel) (EvaValue{.type = EvaValueType::OBJECT, .object = (Object*)new ChannelObject(channel)})
 
 #define CELL(cellObject) OBJECT((Object*)cellObject)
 
@@ -364,13 +641,18 @@ struct FunctionObject : public Object {
 #define AS_CELL(evaValue) ((CellObject*)(evaValue).object)
 #define AS_CLASS(evaValue) ((ClassObject*)(evaValue).object)
 #define AS_INSTANCE(evaValue) ((InstanceObject*)(evaValue).object)
+#define AS_ARRAY(evaValue) ((ArrayObject*)(evaValue).object)
+#define AS_FLOAT64_ARRAY(evaValue) ((Float64ArrayObject*)(evaValue).object)
+#define AS_MAP(evaValue) ((MapObject*)(evaValue).object)
+#define AS_FIBER(evaValue) ((FiberObject*)(evaValue).object)
+#define AS_CHANNEL(evaValue) ((ChannelObject*)(evaValue).object)
 
 // ----------------------------------------------------------------
 // Testers:
 
 #define IS_NUMBER(evaValue) ((evaValue).type == EvaValueType::NUMBER)
 #define IS_BOOLEAN(evaValue) ((evaValue).type == EvaValueType::BOOLEAN)
-#define IS_NUMBER(evaValue) ((evaValue).type == EvaValueType::OBJECT)
+#define IS_OBJECT(evaValue) ((evaValue).type == EvaValueType::OBJECT)
 #define IS_OBJECT_TYPE(evaValue, objectType) (IS_OBJECT(evaValue) && AS_OBJECT(evaValue)->type == objectType)
 #define IS_STRING(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::STRING)
 #define IS_CODE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CODE)
@@ -379,9 +661,242 @@ struct FunctionObject : public Object {
 #define IS_CELL(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CELL)
 #define IS_CLASS(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CLASS)
 #define IS_INSTANCE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::INSTANCE)
+#define IS_ARRAY(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::ARRAY)
+#define IS_FLOAT64_ARRAY(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::FLOAT64_ARRAY)
+#define IS_MAP(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::MAP)
+#define IS_FIBER(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::FIBER)
+#define IS_CHANNEL(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CHANNEL)
 
 // ----------------------------------------------------------------
 
+/**
+ * Map object: hash table with open addressing (Robin Hood).
+ *
+ * Keys are numbers, strings (compared by content) and booleans.
+ * Entries are stored inline in one array; on collision the entry
+ * further from its home slot keeps the slot, which bounds the probe
+ * lengths, and deletion shifts the following entries back instead
+ * of leaving tombstones.
+ *
+ * Slot indices double as iteration cursors (see next). Deleting
+ * during the iteration may move the entries.
+ */
+struct MapObject : public Object {
+  MapObject() : Object(ObjectType::MAP) {}
+
+  /**
+   * Table slot, distance -1 marks an empty slot.
+   */
+  struct Entry {
+      EvaValue key{};
+      EvaValue value{};
+      uint32_t hash = 0;
+      int32_t distance = -1;
+  };
+
+  // Slots (power of two)
+  std::vector<Entry> entries;
+  // Number of entries
+  size_t count = 0;
+
+  /**
+   * Whether the value can be a key (NaN is not equal to itself).
+   */
+  static bool isValidKey(const EvaValue& key) {
+      return (IS_NUMBER(key) && !std::isnan(AS_NUMBER(key))) ||
+             IS_BOOLEAN(key) || IS_STRING(key);
+  }
+
+  /**
+   * Returns the value, nullptr if the key is absent.
+   */
+  EvaValue* get(const EvaValue& key) {
+      auto slot = find(key);
+      return slot == -1 ? nullptr : &entries[slot].value;
+  }
+
+  bool has(const EvaValue& key) { return find(key) != -1; }
+
+  /**
+   * Inserts or updates the entry.
+   */
+  void set(const EvaValue& key, const EvaValue& value) {
+      auto slot = find(key);
+      if (slot != -1) {
+          entries[slot].value = value;
+          return;
+      }
+      // Max load factor 7/8
+      if ((count + 1) * 8 > entries.size() * 7) {
+          rehash(entries.empty() ? 8 : entries.size() * 2);
+      }
+      insert({key, value, hashKey(key), 0});
+      count++;
+  }
+
+  /**
+   * Removes the entry, returns whether it was there.
+   */
+  bool remove(const EvaValue& key) {
+      auto slot = find(key);
+      if (slot == -1) {
+          return false;
+      }
+      // Backward shift of the following displaced entries
+      auto mask = entries.size() - 1;
+      auto next = (slot + 1) & mask;
+      while (entries[next].distance > 0) {
+          entries[slot] = entries[next];
+          entries[slot].distance--;
+          slot = next;
+          next = (next + 1) & mask;
+      }
+      entries[slot] = Entry{};
+      count--;
+      return true;
+  }
+
+  /**
+   * Next occupied slot after the cursor (-1 to start), -1 at the end.
+   */
+  int64_t next(int64_t cursor) {
+      for (auto slot = cursor + 1; slot < (int64_t)entries.size(); slot++) {
+          if (entries[slot].distance >= 0) {
+              return slot;
+          }
+      }
+      return -1;
+  }
+
+  /**
+   * Returns the slot of the key, -1 if absent.
+   */
+  int64_t find(const EvaValue& key) {
+      if (count == 0) {
+          return -1;
+      }
+      auto hash = hashKey(key);
+      auto mask = entries.size() - 1;
+      auto slot = hash & mask;
+      for (int32_t distance = 0;; distance++) {
+          auto& entry = entries[slot];
+          // Empty, or a "richer" entry: the key would have been here
+          if (entry.distance < distance) {
+              return -1;
+          }
+          if (entry.hash == hash && keysEqual(entry.key, key)) {
+              return slot;
+          }
+          slot = (slot + 1) & mask;
+      }
+  }
+
+  /**
+   * Key hash.
+   */
+  static uint32_t hashKey(const EvaValue& key) {
+      uint64_t bits;
+      if (IS_NUMBER(key)) {
+          // -0 and 0 are the same key
+          auto number = AS_NUMBER(key) == 0 ? 0.0 : AS_NUMBER(key);
+          std::memcpy(&bits, &number, sizeof(bits));
+      } else if (IS_BOOLEAN(key)) {
+          bits = AS_BOOLEAN(key) ? 0x9e3779b97f4a7c15ull : 0x7f4a7c159e3779b9ull;
+      } else {
+          bits = std::hash<std::string>{}(AS_CPPSTRING(key));
+      }
+      // Finalizer (splitmix64), spreads the bits to the low slots
+      bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ull;
+      bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebull;
+      return (uint32_t)(bits ^ (bits >> 31));
+  }
+
+  static bool keysEqual(const EvaValue& a, const EvaValue& b) {
+      if (a.type != b.type) {
+          return false;
+      }
+      if (IS_NUMBER(a)) {
+          return AS_NUMBER(a) == AS_NUMBER(b);
+      }
+      if (IS_BOOLEAN(a)) {
+          return AS_BOOLEAN(a) == AS_BOOLEAN(b);
+      }
+      return IS_STRING(a) && IS_STRING(b) && AS_CPPSTRING(a) == AS_CPPSTRING(b);
+  }
+
+ private:
+  /**
+   * Robin Hood insertion of a new entry.
+   */
+  void insert(Entry entry) {
+      auto mask = entries.size() - 1;
+      auto slot = entry.hash & mask;
+      for (;;) {
+          auto& current = entries[slot];
+          if (current.distance < 0) {
+              current = entry;
+              return;
+          }
+          // Take the slot from the entry closer to its home
+          if (current.distance < entry.distance) {
+              std::swap(current, entry);
+          }
+          slot = (slot + 1) & mask;
+          entry.distance++;
+      }
+  }
+
+  /**
+   * Resizes the table, reinserting the entries.
+   */
+  void rehash(size_t capacity) {
+      std::vector<Entry> old(capacity);
+      old.swap(entries);
+      grow((entries.capacity() - old.capacity()) * sizeof(Entry));
+      for (auto& entry : old) {
+          if (entry.distance >= 0) {
+              entry.distance = 0;
+              insert(entry);
+          }
+      }
+  }
+};
+
+// ----------------------------------------------------------------
+
+/**
+ * Object type name.
+ */
+std::string objectTypeToString(ObjectType type) {
+  switch (type) {
+      case ObjectType::STRING:
+          return "STRING";
+      case ObjectType::CODE:
+          return "CODE";
+      case ObjectType::NATIVE:
+          return "NATIVE";
+      case ObjectType::FUNCTION:
+          return "FUNCTION";
+      case ObjectType::CELL:
+          return "CELL";
+      case ObjectType::CLASS:
+          return "CLASS";
+      case ObjectType::INSTANCE:
+          return "INSTANCE";
+      case ObjectType::ARRAY:
+          return "ARRAY";
+      case ObjectType::FLOAT64_ARRAY:
+          return "FLOAT64_ARRAY";
+      case ObjectType::MAP:
+          return "MAP";
+      case ObjectType::FIBER:
+          return "FIBER";
+      case ObjectType::CHANNEL:
+          return "CHANNEL";
+  }
+  return ""; // Unreachable
+}
+
 /**
  * String representation used in constants for debug.
  */
@@ -404,6 +919,16 @@ std::string evaValueToTypeString(const EvaValue& evaValue) {
       return "CLASS";
   } else if (IS_INSTANCE(evaValue)) {
       return "INSTANCE";
+  } else if (IS_ARRAY(evaValue)) {
+      return "ARRAY";
+  } else if (IS_FLOAT64_ARRAY(evaValue)) {
+      return "FLOAT64_ARRAY";
+  } else if (IS_MAP(evaValue)) {
+      return "MAP";
+  } else if (IS_FIBER(evaValue)) {
+      return "FIBER";
+  } else if (IS_CHANNEL(evaValue)) {
+      return "CHANNEL";
   } else {
       DIE << "evaValueToTypeString: unknown type " << (int)evaValue.type;
   }
@@ -433,11 +958,11 @@ std::string evaValueToConstantString(const EvaValue& evaValue) {
         ss << fn->co->name << "/" << fn->co->arity;
     }
     else if (IS_NATIVE(evaValue)) {
-        auto code = AS_NATIVE(evaValue);
+        auto fn = AS_NATIVE(evaValue);
         ss << fn->name << "/" << fn->arity;
     }
     else if (IS_CELL(evaValue)) {
-        auto code = AS_CELL(evaValue);
+        auto cell = AS_CELL(evaValue);
         ss << "cell: " << evaValueToConstantString(cell->value);
     }
     else if (IS_CLASS(evaValue)) {
@@ -448,6 +973,24 @@ std::string evaValueToConstantString(const EvaValue& evaValue) {
         auto instance = AS_INSTANCE(evaValue);
         ss << "instance: " << instance->cls->name;
     }
+    else if (IS_ARRAY(evaValue)) {
+        auto array = AS_ARRAY(evaValue);
+        ss << "array: " << array->elements.size() << " elements";
+    }
+    else if (IS_FLOAT64_ARRAY(evaValue)) {
+        auto array = AS_FLOAT64_ARRAY(evaValue);
+        ss << "float64-array: " << array->data.size() << " elements";
+    }
+    else if (IS_MAP(evaValue)) {
+        ss << "map: " << AS_MAP(evaValue)->count << " entries";
+    }
+    else if (IS_FIBER(evaValue)) {
+        auto fiber = AS_FIBER(evaValue);
+        ss << "fiber: " << (fiber->state == FiberState::DONE ? "done" : "pending");
+    }
+    else if (IS_CHANNEL(evaValue)) {
+        ss << "channel";
+    }
     else {
         DIE << "evaValueToConstantString: unknown type " << (int)evaValue.type;
     }
@@ -0,0 +1,651 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Event loop for the async I/O natives.
+ */
+
+#ifndef EventLoop_h
+#define EventLoop_h
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../Logger.h"
+#include "Channel.h"
+#include "EvaValue.h"
+
+/**
+ * Worker threads for the file operations.
+ */
+#define IO_WORKERS 4
+
+/**
+ * Max bytes returned by one fd read.
+ */
+#define IO_READ_CHUNK 65536
+
+/**
+ * Max events handled per poll.
+ */
+#define IO_MAX_EVENTS 64
+
+/**
+ * Result type of a completed operation.
+ */
+enum class IoResultType {
+  NONE,
+  STRING,
+  NUMBER,
+  MESSAGE,
+};
+
+/**
+ * Completed operation: the waiting fiber is resumed with the result.
+ */
+struct IoCompletion {
+  IoCompletion(FiberObject* fiber, IoResultType type = IoResultType::NONE)
+      : fiber(fiber), type(type) {}
+
+  FiberObject* fiber;
+  IoResultType type;
+  std::string data;
+  double number = 0;
+  ChannelMessage message;
+  // Error message (empty on success)
+  std::string error;
+};
+
+/**
+ * Event loop (epoll): the fibers calling async natives wait here
+ * for their operations, and the VM resumes them on completion.
+ *
+ * - pipes and sockets are non-blocking, and wait for readiness
+ * - timers are timerfds
+ * - regular files are always "ready" for epoll, so file operations
+ *   run on worker threads, which post the results and wake the loop
+ *   through an eventfd
+ * - channel operations are retried when the channel notifies the
+ *   same eventfd
+ *
+ * The loop is owned by one VM and used from its thread only (the
+ * workers only touch the job and the completion queues). Fds are
+ * owned by the loop: scripts can only use the fds it opened.
+ */
+class EventLoop {
+ public:
+  EventLoop()
+      : epollFd_(epoll_create1(EPOLL_CLOEXEC)),
+        wakeFd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+      if (epollFd_ == -1 || wakeFd_ == -1) {
+          DIE << "[EventLoop]: Can't create the event loop: " << strerror(errno);
+      }
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.fd = wakeFd_;
+      epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &event);
+  }
+
+  ~EventLoop() {
+      {
+          std::lock_guard<std::mutex> lock(mutex_);
+          stopping_ = true;
+      }
+      jobsReady_.notify_all();
+      for (auto& worker : workers_) {
+          worker.join();
+      }
+      for (auto& wait : channelWaits_) {
+          wait.channel->removeWaiter(wakeFd_);
+      }
+      for (auto& timer : timers_) {
+          ::close(timer.first);
+      }
+      for (auto fd : fds_) {
+          ::close(fd);
+      }
+      ::close(wakeFd_);
+      ::close(epollFd_);
+  }
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  /**
+   * Number of operations in progress.
+   */
+  size_t pending() {
+      return waiting_ + timers_.size() + jobsInFlight_ + channelWaits_.size();
+  }
+
+  // --------------------------------------------------
+  // Files (worker threads):
+
+  /**
+   * Reads the whole file.
+   */
+  void readFile(FiberObject* fiber, const std::string& path) {
+      submit(fiber, [path](IoCompletion& completion) {
+          std::ifstream file(path, std::ios::binary);
+          if (!file) {
+              completion.error = "Can't open file " + path;
+              return;
+          }
+          completion.type = IoResultType::STRING;
+          completion.data.assign(std::istreambuf_iterator<char>(file),
+                                 std::istreambuf_iterator<char>());
+      });
+  }
+
+  /**
+   * Writes (replaces) the file, the result is the number of bytes.
+   */
+  void writeFile(FiberObject* fiber, const std::string& path,
+                 const std::string& data) {
+      submit(fiber, [path, data](IoCompletion& completion) {
+          std::ofstream file(path, std::ios::binary | std::ios::trunc);
+          if (!file.write(data.data(), data.size())) {
+              completion.error = "Can't write file " + path;
+              return;
+          }
+          completion.type = IoResultType::NUMBER;
+          completion.number = data.size();
+      });
+  }
+
+  // --------------------------------------------------
+  // Timers:
+
+  /**
+   * Resumes the fiber after the delay.
+   */
+  void sleep(FiberObject* fiber, double ms) {
+      auto fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (fd == -1) {
+          DIE << "[EventLoop]: Can't create a timer: " << strerror(errno);
+      }
+      auto ns = ms > 0 ? (int64_t)(ms * 1e6) : 0;
+      itimerspec spec{};
+      spec.it_value.tv_sec = ns / 1000000000;
+      // Zero disarms the timer
+      spec.it_value.tv_nsec = ns % 1000000000 + (ns == 0 ? 1 : 0);
+      timerfd_settime(fd, 0, &spec, nullptr);
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.fd = fd;
+      epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+      timers_[fd] = fiber;
+  }
+
+  // --------------------------------------------------
+  // Pipes and sockets:
+
+  /**
+   * Opens a pipe: {read end, write end}.
+   */
+  std::pair<int, int> pipe() {
+      int fds[2];
+      if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+          DIE << "[EventLoop]: Can't create a pipe: " << strerror(errno);
+      }
+      fds_.insert(fds[0]);
+      fds_.insert(fds[1]);
+      return {fds[0], fds[1]};
+  }
+
+  /**
+   * Opens a pair of connected local sockets.
+   */
+  std::pair<int, int> socketPair() {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                     fds) == -1) {
+          DIE << "[EventLoop]: Can't create a socket pair: " << strerror(errno);
+      }
+      fds_.insert(fds[0]);
+      fds_.insert(fds[1]);
+      return {fds[0], fds[1]};
+  }
+
+  /**
+   * Whether the fd was opened by the loop (and is not closed).
+   */
+  bool owns(int fd) { return fds_.count(fd) != 0; }
+
+  /**
+   * Closes the fd.
+   */
+  void close(int fd) {
+      if (watchers_.count(fd) != 0) {
+          DIE << "[EventLoop]: Can't close fd " << fd << " with pending operations";
+      }
+      fds_.erase(fd);
+      ::close(fd);
+  }
+
+  /**
+   * Reads the available data (empty at the end of input). Returns
+   * false if nothing is available: the fiber waits for the data.
+   */
+  bool read(FiberObject* fiber, int fd, std::string& data) {
+      auto& watcher = watchers_[fd];
+      if (watcher.reader != nullptr) {
+          DIE << "[EventLoop]: fd " << fd << " is already being read";
+      }
+      std::string error;
+      if (readSome(fd, data, error)) {
+          dropIfIdle(fd);
+          return true;
+      }
+      if (!error.empty()) {
+          DIE << "[EventLoop]: " << error;
+      }
+      watcher.reader = fiber;
+      waiting_++;
+      updateInterest(fd);
+      return false;
+  }
+
+  /**
+   * Writes all the data. Returns false if it can't be written
+   * right away: the fiber waits until the rest is written.
+   */
+  bool write(FiberObject* fiber, int fd, const std::string& data) {
+      auto& watcher = watchers_[fd];
+      if (watcher.writer != nullptr) {
+          DIE << "[EventLoop]: fd " << fd << " is already being written";
+      }
+      watcher.output = data;
+      watcher.written = 0;
+      std::string error;
+      if (writeSome(fd, watcher, error)) {
+          watcher.output.clear();
+          dropIfIdle(fd);
+          return true;
+      }
+      if (!error.empty()) {
+          DIE << "[EventLoop]: " << error;
+      }
+      watcher.writer = fiber;
+      waiting_++;
+      updateInterest(fd);
+      return false;
+  }
+
+  // --------------------------------------------------
+  // Channels:
+
+  /**
+   * Sends the message. Returns false if the channel is full:
+   * the fiber waits, and the message is sent once there's space.
+   */
+  bool send(FiberObject* fiber, const std::shared_ptr<Channel>& channel,
+            ChannelMessage& message) {
+      return channelOp(fiber, channel, /* isSend */ true, message);
+  }
+
+  /**
+   * Receives a message. Returns false if the channel is empty:
+   * the fiber waits, and gets the message on completion.
+   */
+  bool receive(FiberObject* fiber, const std::shared_ptr<Channel>& channel,
+               ChannelMessage& message) {
+      return channelOp(fiber, channel, /* isSend */ false, message);
+  }
+
+  // --------------------------------------------------
+  // Polling:
+
+  /**
+   * Waits for the events (up to timeoutMs, -1 is infinite), and
+   * returns the completed operations.
+   */
+  std::vector<IoCompletion> poll(int timeoutMs) {
+      std::vector<IoCompletion> completions;
+      epoll_event events[IO_MAX_EVENTS];
+      auto count = epoll_wait(epollFd_, events, IO_MAX_EVENTS, timeoutMs);
+      if (count == -1 && errno != EINTR) {
+          DIE << "[EventLoop]: epoll_wait failed: " << strerror(errno);
+      }
+      for (auto i = 0; i < count; i++) {
+          auto fd = events[i].data.fd;
+          auto ready = events[i].events;
+
+          // Worker results
+          if (fd == wakeFd_) {
+              uint64_t posted;
+              ::read(wakeFd_, &posted, sizeof(posted));
+              {
+                  std::lock_guard<std::mutex> lock(mutex_);
+                  while (!done_.empty()) {
+                      completions.push_back(std::move(done_.front()));
+                      done_.pop_front();
+                      jobsInFlight_--;
+                  }
+              }
+              retryChannels(completions);
+              continue;
+          }
+
+          // Timers
+          auto timer = timers_.find(fd);
+          if (timer != timers_.end()) {
+              completions.push_back({timer->second});
+              epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+              ::close(fd);
+              timers_.erase(timer);
+              continue;
+          }
+
+          // Pipes and sockets (errors and hang-ups complete both sides)
+          auto& watcher = watchers_[fd];
+          auto failed = (ready & (EPOLLERR | EPOLLHUP)) != 0;
+          if (watcher.reader != nullptr && (ready & EPOLLIN || failed)) {
+              IoCompletion completion{watcher.reader, IoResultType::STRING};
+              if (readSome(fd, completion.data, completion.error) ||
+                  !completion.error.empty()) {
+                  completions.push_back(std::move(completion));
+                  watcher.reader = nullptr;
+                  waiting_--;
+              }
+          }
+          if (watcher.writer != nullptr && (ready & EPOLLOUT || failed)) {
+              IoCompletion completion{watcher.writer, IoResultType::NUMBER};
+              if (writeSome(fd, watcher, completion.error) ||
+                  !completion.error.empty()) {
+                  completion.number = watcher.written;
+                  completions.push_back(std::move(completion));
+                  watcher.writer = nullptr;
+                  watcher.output.clear();
+                  waiting_--;
+              }
+          }
+          updateInterest(fd);
+      }
+      return completions;
+  }
+
+ private:
+  /**
+   * Waiting operations on an fd.
+   */
+  struct Watcher {
+      FiberObject* reader = nullptr;
+      FiberObject* writer = nullptr;
+      // Pending output
+      std::string output;
+      size_t written = 0;
+      // Events registered in epoll
+      uint32_t events = 0;
+  };
+
+  /**
+   * Fiber waiting to send (the pending message) or to receive.
+   */
+  struct ChannelWait {
+      FiberObject* fiber;
+      std::shared_ptr<Channel> channel;
+      bool isSend;
+      ChannelMessage message;
+  };
+
+  /**
+   * Tries the channel operation, otherwise registers the wait.
+   */
+  bool channelOp(FiberObject* fiber, const std::shared_ptr<Channel>& channel,
+                 bool isSend, ChannelMessage& message) {
+      auto tryOp = [&]() {
+          return isSend ? channel->trySend(message) : channel->tryReceive(message);
+      };
+      if (tryOp()) {
+          return true;
+      }
+      channel->addWaiter(wakeFd_);
+      // The other side could have completed before the waiter was added
+      if (tryOp()) {
+          channel->removeWaiter(wakeFd_);
+          return true;
+      }
+      channelWaits_.push_back({fiber, channel, isSend, std::move(message)});
+      return false;
+  }
+
+  /**
+   * Completes the channel waits which can proceed now.
+   */
+  void retryChannels(std::vector<IoCompletion>& completions) {
+      for (auto wait = channelWaits_.begin(); wait != channelWaits_.end();) {
+          auto done = wait->isSend ? wait->channel->trySend(wait->message)
+                                   : wait->channel->tryReceive(wait->message);
+          if (!done) {
+              ++wait;
+              continue;
+          }
+          wait->channel->removeWaiter(wakeFd_);
+          IoCompletion completion{wait->fiber};
+          if (!wait->isSend) {
+              completion.type = IoResultType::MESSAGE;
+              completion.message = std::move(wait->message);
+          }
+          completions.push_back(std::move(completion));
+          wait = channelWaits_.erase(wait);
+      }
+  }
+
+  /**
+   * File job for the workers.
+   */
+  struct Job {
+      FiberObject* fiber;
+      std::function<void(IoCompletion&)> run;
+  };
+
+  /**
+   * Non-blocking read: false if no data is available (or on error).
+   */
+  static bool readSome(int fd, std::string& data, std::string& error) {
+      char buffer[IO_READ_CHUNK];
+      auto count = ::read(fd, buffer, sizeof(buffer));
+      if (count >= 0) {
+          data.assign(buffer, count);
+          return true;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          error = "Read from fd " + std::to_string(fd) + " failed: " + strerror(errno);
+      }
+      return false;
+  }
+
+  /**
+   * Writes to a pipe or a socket without raising SIGPIPE (a closed
+   * reader is an EPIPE error), and without changing the process-wide
+   * disposition of the signal: sockets are written with MSG_NOSIGNAL,
+   * pipes with SIGPIPE blocked on this thread (the signal raised by
+   * the write is discarded).
+   */
+  static ssize_t writeNoSignal(int fd, const char* data, size_t size) {
+      auto count = ::send(fd, data, size, MSG_NOSIGNAL);
+      if (count != -1 || errno != ENOTSOCK) {
+          return count;
+      }
+      sigset_t pipeSignal;
+      sigset_t pending;
+      sigset_t previousMask;
+      sigemptyset(&pipeSignal);
+      sigaddset(&pipeSignal, SIGPIPE);
+      sigpending(&pending);
+      auto wasPending = sigismember(&pending, SIGPIPE);
+      pthread_sigmask(SIG_BLOCK, &pipeSignal, &previousMask);
+      count = ::write(fd, data, size);
+      auto error = errno;
+      if (count == -1 && error == EPIPE && !wasPending) {
+          timespec noWait{0, 0};
+          sigtimedwait(&pipeSignal, nullptr, &noWait);
+      }
+      pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+      errno = error;
+      return count;
+  }
+
+  /**
+   * Non-blocking write of the pending output: false if it's
+   * not written completely (or on error).
+   */
+  static bool writeSome(int fd, Watcher& watcher, std::string& error) {
+      while (watcher.written < watcher.output.size()) {
+          auto count = writeNoSignal(fd, watcher.output.data() + watcher.written,
+                                     watcher.output.size() - watcher.written);
+          if (count == -1) {
+              if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                  error = "Write to fd " + std::to_string(fd) + " failed: " + strerror(errno);
+              }
+              return false;
+          }
+          watcher.written += count;
+      }
+      return true;
+  }
+
+  /**
+   * Registers the events of the waiting operations on the fd.
+   */
+  void updateInterest(int fd) {
+      auto& watcher = watchers_[fd];
+      uint32_t events = (watcher.reader != nullptr ? (uint32_t)EPOLLIN : 0) |
+                        (watcher.writer != nullptr ? (uint32_t)EPOLLOUT : 0);
+      if (events == watcher.events) {
+          dropIfIdle(fd);
+          return;
+      }
+      epoll_event event{};
+      event.events = events;
+      event.data.fd = fd;
+      if (events == 0) {
+          epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+      } else {
+          epoll_ctl(epollFd_, watcher.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                    fd, &event);
+      }
+      watcher.events = events;
+      dropIfIdle(fd);
+  }
+
+  /**
+   * Forgets the fd watcher without waiting operations.
+   */
+  void dropIfIdle(int fd) {
+      auto& watcher = watchers_[fd];
+      if (watcher.reader == nullptr && watcher.writer == nullptr &&
+          watcher.events == 0) {
+          watchers_.erase(fd);
+      }
+  }
+
+  /**
+   * Queues the file job, starting the workers on first use.
+   */
+  void submit(FiberObject* fiber, std::function<void(IoCompletion&)> run) {
+      if (workers_.empty()) {
+          for (auto i = 0; i < IO_WORKERS; i++) {
+              workers_.emplace_back([this]() { work(); });
+          }
+      }
+      {
+          std::lock_guard<std::mutex> lock(mutex_);
+          jobs_.push_back({fiber, std::move(run)});
+      }
+      jobsInFlight_++;
+      jobsReady_.notify_one();
+  }
+
+  /**
+   * Worker thread: runs the jobs, posts the results.
+   */
+  void work() {
+      for (;;) {
+          Job job;
+          {
+              std::unique_lock<std::mutex> lock(mutex_);
+              jobsReady_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+              if (stopping_) {
+                  return;
+              }
+              job = std::move(jobs_.front());
+              jobs_.pop_front();
+          }
+          IoCompletion completion{job.fiber};
+          job.run(completion);
+          {
+              std::lock_guard<std::mutex> lock(mutex_);
+              done_.push_back(std::move(completion));
+          }
+          uint64_t posted = 1;
+          ::write(wakeFd_, &posted, sizeof(posted));
+      }
+  }
+
+  int epollFd_;
+
+  /**
+   * Workers wake up the loop through this eventfd.
+   */
+  int wakeFd_;
+
+  /**
+   * Fds opened by the loop, and the ones with waiting operations.
+   */
+  std::unordered_set<int> fds_;
+  std::unordered_map<int, Watcher> watchers_;
+  size_t waiting_ = 0;
+
+  /**
+   * Fibers waiting on channels.
+   */
+  std::list<ChannelWait> channelWaits_;
+
+  /**
+   * Timer fds and their fibers.
+   */
+  std::unordered_map<int, FiberObject*> timers_;
+
+  /**
+   * Worker threads, job and result queues (guarded by the mutex).
+   */
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable jobsReady_;
+  std::deque<Job> jobs_;
+  std::deque<IoCompletion> done_;
+  bool stopping_ = false;
+  size_t jobsInFlight_ = 0;
+};
+
+#endif
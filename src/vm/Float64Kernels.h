@@ -0,0 +1,184 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Bulk kernels for Float64 arrays.
+ */
+
+#ifndef Float64Kernels_h
+#define Float64Kernels_h
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Kernels over raw doubles, used by the f64-* natives.
+ *
+ * With AVX2 enabled at build time (e.g. -mavx2 -mfma, /arch:AVX2)
+ * the kernels use 256-bit intrinsics (4 doubles per instruction),
+ * otherwise plain loops the compiler vectorizes with SSE2.
+ * Reductions keep 4 independent partial results in both versions,
+ * so the summation order (and rounding) doesn't depend on the build.
+ *
+ * Destination arrays may alias the sources.
+ */
+namespace float64 {
+
+/**
+ * dst = a + b
+ */
+inline void add(double* dst, const double* a, const double* b, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                              _mm256_loadu_pd(b + i)));
+  }
+#endif
+  for (; i < n; i++) {
+      dst[i] = a[i] + b[i];
+  }
+}
+
+/**
+ * dst = a * b
+ */
+inline void mul(double* dst, const double* a, const double* b, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                              _mm256_loadu_pd(b + i)));
+  }
+#endif
+  for (; i < n; i++) {
+      dst[i] = a[i] * b[i];
+  }
+}
+
+/**
+ * dst = a * b + c (fused if the target has FMA instructions)
+ */
+inline void fma(double* dst, const double* a, const double* b, const double* c,
+                size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  for (; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(dst + i, _mm256_fmadd_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i),
+                                                _mm256_loadu_pd(c + i)));
+  }
+#endif
+  for (; i < n; i++) {
+#if defined(__FMA__) || defined(FP_FAST_FMA)
+      dst[i] = std::fma(a[i], b[i], c[i]);
+#else
+      dst[i] = a[i] * b[i] + c[i];
+#endif
+  }
+}
+
+/**
+ * dst = a * k
+ */
+inline void scale(double* dst, const double* a, double k, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  auto vk = _mm256_set1_pd(k);
+  for (; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), vk));
+  }
+#endif
+  for (; i < n; i++) {
+      dst[i] = a[i] * k;
+  }
+}
+
+/**
+ * Sum of a * b (or of a, if b is nullptr).
+ */
+inline double dotOrSum(const double* a, const double* b, size_t n) {
+  size_t i = 0;
+  double acc[4] = {0, 0, 0, 0};
+#if defined(__AVX2__)
+  auto vacc = _mm256_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+      auto va = _mm256_loadu_pd(a + i);
+      vacc = _mm256_add_pd(
+          vacc, b == nullptr ? va : _mm256_mul_pd(va, _mm256_loadu_pd(b + i)));
+  }
+  _mm256_storeu_pd(acc, vacc);
+#else
+  for (; i + 4 <= n; i += 4) {
+      for (size_t j = 0; j < 4; j++) {
+          acc[j] += b == nullptr ? a[i + j] : a[i + j] * b[i + j];
+      }
+  }
+#endif
+  for (; i < n; i++) {
+      acc[i % 4] += b == nullptr ? a[i] : a[i] * b[i];
+  }
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+inline double sum(const double* a, size_t n) { return dotOrSum(a, nullptr, n); }
+
+inline double dot(const double* a, const double* b, size_t n) {
+  return dotOrSum(a, b, n);
+}
+
+/**
+ * Min (or max) element, +inf (-inf) for empty arrays.
+ */
+template <bool isMax>
+inline double extremum(const double* a, size_t n) {
+  size_t i = 0;
+  double acc[4];
+  for (auto& value : acc) {
+      value = isMax ? -INFINITY : INFINITY;
+  }
+#if defined(__AVX2__)
+  auto vacc = _mm256_loadu_pd(acc);
+  for (; i + 4 <= n; i += 4) {
+      auto va = _mm256_loadu_pd(a + i);
+      vacc = isMax ? _mm256_max_pd(vacc, va) : _mm256_min_pd(vacc, va);
+  }
+  _mm256_storeu_pd(acc, vacc);
+#else
+  for (; i + 4 <= n; i += 4) {
+      for (size_t j = 0; j < 4; j++) {
+          acc[j] = isMax ? (acc[j] > a[i + j] ? acc[j] : a[i + j])
+                         : (acc[j] < a[i + j] ? acc[j] : a[i + j]);
+      }
+  }
+#endif
+  for (; i < n; i++) {
+      acc[i % 4] = isMax ? (acc[i % 4] > a[i] ? acc[i % 4] : a[i])
+                         : (acc[i % 4] < a[i] ? acc[i % 4] : a[i]);
+  }
+  auto result = acc[0];
+  for (auto value : acc) {
+      result = isMax ? (result > value ? result : value)
+                     : (result < value ? result : value);
+  }
+  return result;
+}
+
+inline double min(const double* a, size_t n) { return extremum<false>(a, n); }
+
+inline double max(const double* a, size_t n) { return extremum<true>(a, n); }
+
+}  // namespace float64
+
+#endif
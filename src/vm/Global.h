@@ -15,6 +15,13 @@
 #ifndef Global_h
 #define Global_h
 
+#include <unordered_map>
+
+/**
+ * Max number of globals (2-byte operand of OP_GET_GLOBAL/OP_SET_GLOBAL).
+ */
+#define GLOBALS_LIMIT 65536
+
 /**
  * Global var.
  */
@@ -23,6 +30,15 @@ struct GlobalVar {
     EvaValue value;
 };
 
+/**
+ * Native function registration entry.
+ */
+struct NativeDef {
+    const char* name;
+    NativeFn function;
+    size_t arity;
+};
+
 /**
  * Global object.
  */
@@ -52,18 +68,28 @@ struct Global {
           return;
       }
       // Set to default number 0
-      globals.push_back({ name, NUMBER(0) });
+      add(name, NUMBER(0));
   }
 
   /**
    * Adds a native function.
    */
-  void addNativeFunction(const std::string& name, std::function<void()> fn,
-                         size_t arity) {
+  void addNativeFunction(const std::string& name, NativeFn fn, size_t arity) {
       if (exists(name)) {
           return;
       }
-      globals.push_back({name, ALLOC_NATIVE(fn, name, arity)});
+      add(name, ALLOC_NATIVE(fn, name, arity));
+  }
+
+  /**
+   * Adds a table of native functions.
+   */
+  void addNativeFunctions(const NativeDef* natives, size_t count) {
+      globals.reserve(globals.size() + count);
+      indices.reserve(indices.size() + count);
+      for (size_t i = 0; i < count; i++) {
+          addNativeFunction(natives[i].name, natives[i].function, natives[i].arity);
+      }
   }
 
   /**
@@ -73,21 +99,15 @@ struct Global {
       if (exists(name)) {
           return;
       }
-      globals.push_back({ name, NUMBER(value) });
+      add(name, NUMBER(value));
   }
 
   /**
    * Get global index.
    */
   int getGlobalIndex(const std::string& name) {
-      if (globals.size() > 0) {
-          for (auto i = (int)globals.size() - 1; i >= 0; i--) {
-              if (globals[i].name == name) {
-                  return i;
-              }
-          }
-      }
-      return -1;
+      auto it = indices.find(name);
+      return it == indices.end() ? -1 : it->second;
   }
 
   /**
@@ -99,6 +119,23 @@ struct Global {
    * Global variables and functions.
    */
   std::vector<GlobalVar> globals;
+
+  /**
+   * Global name to index.
+   */
+  std::unordered_map<std::string, int> indices;
+
+ private:
+  /**
+   * Appends a new global.
+   */
+  void add(const std::string& name, const EvaValue& value) {
+      if (globals.size() >= GLOBALS_LIMIT) {
+          DIE << "Too many globals (" << GLOBALS_LIMIT << "), can't add " << name;
+      }
+      indices[name] = (int)globals.size();
+      globals.push_back({ name, value });
+  }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,559 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Heap snapshot (.evas files).
+ */
+
+#ifndef HeapSnapshot_h
+#define HeapSnapshot_h
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../bytecode/BinaryIO.h"
+#include "../gc/EvaCollector.h"
+#include "EvaValue.h"
+#include "Global.h"
+
+/**
+ * File magic.
+ */
+#define EVAS_MAGIC "EVAS"
+
+/**
+ * Format version.
+ */
+#define EVAS_VERSION 4
+
+/**
+ * Null object reference.
+ */
+#define EVAS_NULL 0xFFFFFFFF
+
+/**
+ * Snapshot file header.
+ *
+ * Followed by the sections:
+ *
+ *   types:    u8 ObjectType per object
+ *   natives:  <name> per native object (rebound by name on restore)
+ *   objects:  payload per object, pointers are object indices
+ *   globals:  (<name> <value>)*
+ */
+struct EvasHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t objectsCount;
+  uint32_t globalsCount;
+};
+
+/**
+ * Serialized value tag.
+ */
+enum class EvasValueTag : uint8_t {
+  NUMBER,
+  BOOLEAN,
+  OBJECT,
+};
+
+/**
+ * Heap snapshot: saves the heap reachable from the globals (classes,
+ * functions, code, instances, etc), and restores it into a fresh VM,
+ * relocating the pointers, so the prelude doesn't need to re-run.
+ */
+class HeapSnapshot {
+ public:
+  HeapSnapshot(std::shared_ptr<Global> global) : global(global) {}
+
+  /**
+   * Saves the heap reachable from the globals to the file.
+   */
+  bool save(const std::string& fileName) {
+      // Object table: trace the heap from the globals
+      objectIndex_.clear();
+      objects_.clear();
+      EvaCollector collector;
+      std::vector<Traceable*> worklist;
+      for (const auto& globalVar : global->globals) {
+          if (IS_OBJECT(globalVar.value)) {
+              worklist.push_back((Traceable*)AS_OBJECT(globalVar.value));
+          }
+      }
+      while (!worklist.empty()) {
+          auto object = (Object*)worklist.back();
+          worklist.pop_back();
+          if (objectIndex_.count(object) != 0) {
+              continue;
+          }
+          // Fibers are execution state (stacks, saved registers),
+          // channels are shared with the other isolates of the process
+          if (object->type == ObjectType::FIBER ||
+              object->type == ObjectType::CHANNEL) {
+              return false;
+          }
+          objectIndex_[object] = objects_.size();
+          objects_.push_back(object);
+          for (auto& p : collector.getPointers(object)) {
+              worklist.push_back(p);
+          }
+      }
+
+      BinaryWriter out;
+      EvasHeader header{};
+      std::memcpy(header.magic, EVAS_MAGIC, 4);
+      header.version = EVAS_VERSION;
+      header.objectsCount = objects_.size();
+      header.globalsCount = global->globals.size();
+      out.bytes(&header, sizeof(header));
+      // Types
+      for (const auto& object : objects_) {
+          out.u8((uint8_t)object->type);
+      }
+      // Natives
+      for (const auto& object : objects_) {
+          if (object->type == ObjectType::NATIVE) {
+              out.string(((NativeObject*)object)->name);
+          }
+      }
+      // Objects
+      for (const auto& object : objects_) {
+          writeObject(out, object);
+      }
+      // Globals
+      for (const auto& globalVar : global->globals) {
+          out.string(globalVar.name);
+          writeValue(out, globalVar.value);
+      }
+      return out.writeFile(fileName);
+  }
+
+  /**
+   * Restores the heap and the globals from the file.
+   *
+   * The VM should have the same natives registered as the
+   * one which saved the snapshot.
+   */
+  bool restore(const std::string& fileName) {
+      size_t size;
+      auto data = files_.map(fileName, size, sizeof(EvasHeader));
+      if (data == nullptr) {
+          return false;
+      }
+      // Otherwise code objects reference the bytecode in the mapping
+      if (!restoreMapped(data, size)) {
+          files_.unmapLast();
+          return false;
+      }
+      return true;
+  }
+
+ private:
+  /**
+   * Restores the mapped snapshot.
+   */
+  bool restoreMapped(uint8_t* data, size_t size) {
+      EvasHeader header;
+      std::memcpy(&header, data, sizeof(header));
+      if (std::memcmp(header.magic, EVAS_MAGIC, 4) != 0 ||
+          header.version != EVAS_VERSION) {
+          return false;
+      }
+      BinaryReader in(data + sizeof(header), data + size);
+      auto types = in.bytes(header.objectsCount);
+      if (types == nullptr) {
+          return false;
+      }
+      // Object shells, natives are rebound by name
+      objects_.clear();
+      for (uint32_t i = 0; i < header.objectsCount; i++) {
+          auto object = allocateShell((ObjectType)types[i], in);
+          if (object == nullptr) {
+              return false;
+          }
+          objects_.push_back(object);
+      }
+      // Payloads
+      mapEntries_.clear();
+      for (auto& object : objects_) {
+          readObject(in, object);
+      }
+      // Map entries, once the key strings have their contents
+      // (maps hash and compare strings by value)
+      for (const auto& entry : mapEntries_) {
+          entry.map->set(entry.key, entry.value);
+      }
+      mapEntries_.clear();
+      // Globals: the VM globals should be a prefix of the saved ones
+      std::vector<GlobalVar> globals(header.globalsCount);
+      for (auto& globalVar : globals) {
+          globalVar.name = in.string();
+          globalVar.value = readValue(in);
+      }
+      if (!in.ok || globals.size() < global->globals.size()) {
+          return false;
+      }
+      for (size_t i = 0; i < global->globals.size(); i++) {
+          if (global->globals[i].name != globals[i].name) {
+              return false;
+          }
+      }
+      for (const auto& globalVar : globals) {
+          global->define(globalVar.name);
+          global->set(global->getGlobalIndex(globalVar.name), globalVar.value);
+      }
+      return true;
+  }
+
+  /**
+   * Allocates an empty object of the type.
+   */
+  Object* allocateShell(ObjectType type, BinaryReader& in) {
+      switch (type) {
+          case ObjectType::STRING:
+              return AS_OBJECT(ALLOC_STRING(""));
+          case ObjectType::CODE:
+              return AS_OBJECT(ALLOC_CODE("", 0));
+          case ObjectType::NATIVE: {
+              auto globalIndex = global->getGlobalIndex(in.string());
+              if (globalIndex == -1 || !IS_NATIVE(global->get(globalIndex).value)) {
+                  return nullptr;
+              }
+              return AS_OBJECT(global->get(globalIndex).value);
+          }
+          case ObjectType::FUNCTION:
+              return AS_OBJECT(ALLOC_FUNCTION(nullptr));
+          case ObjectType::CELL:
+              return AS_OBJECT(ALLOC_CELL(NUMBER(0)));
+          case ObjectType::CLASS:
+              return AS_OBJECT(ALLOC_CLASS("", nullptr));
+          case ObjectType::INSTANCE:
+              return AS_OBJECT(ALLOC_INSTANCE(nullptr));
+          case ObjectType::ARRAY:
+              return AS_OBJECT(ALLOC_ARRAY());
+          case ObjectType::FLOAT64_ARRAY:
+              return AS_OBJECT(ALLOC_FLOAT64_ARRAY(0));
+          case ObjectType::MAP:
+              return AS_OBJECT(ALLOC_MAP());
+          // Not in snapshots (saveSnapshot rejects them)
+          case ObjectType::FIBER:
+          case ObjectType::CHANNEL:
+              return nullptr;
+      }
+      return nullptr;
+  }
+
+  /**
+   * Writes object payload.
+   */
+  void writeObject(BinaryWriter& out, Object* object) {
+      auto value = OBJECT(object);
+      switch (object->type) {
+          case ObjectType::STRING:
+              out.string(AS_CPPSTRING(value));
+              break;
+          case ObjectType::NATIVE:
+              break;
+          case ObjectType::CODE: {
+              auto co = AS_CODE(value);
+              out.string(co->name);
+              out.u32(co->arity);
+              out.u32(co->freeCount);
+              out.u8(co->isAsync);
+              out.u32(co->cellNames.size());
+              for (const auto& cellName : co->cellNames) {
+                  out.string(cellName);
+              }
+              out.u32(co->locals.size());
+              for (const auto& local : co->locals) {
+                  out.string(local.name);
+                  out.u32(local.scopeLevel);
+              }
+              out.u32(co->constants.size());
+              for (const auto& constant : co->constants) {
+                  writeValue(out, constant);
+              }
+              out.u32(co->getCodeSize());
+              out.bytes(co->getCode(), co->getCodeSize());
+              out.u32(co->line);
+              out.u32(co->lineTable.size());
+              out.bytes(co->lineTable.data(), co->lineTable.size());
+              break;
+          }
+          case ObjectType::FUNCTION: {
+              auto fn = AS_FUNCTION(value);
+              writeRef(out, fn->co);
+              out.u32(fn->cells.size());
+              for (const auto& cell : fn->cells) {
+                  writeRef(out, cell);
+              }
+              break;
+          }
+          case ObjectType::CELL:
+              writeValue(out, AS_CELL(value)->value);
+              break;
+          case ObjectType::CLASS: {
+              auto cls = AS_CLASS(value);
+              out.string(cls->name);
+              writeRef(out, cls->superClass);
+              writeProperties(out, cls->properties);
+              break;
+          }
+          case ObjectType::INSTANCE: {
+              auto instance = AS_INSTANCE(value);
+              writeRef(out, instance->cls);
+              writeProperties(out, instance->properties);
+              break;
+          }
+          case ObjectType::MAP: {
+              auto map = AS_MAP(value);
+              out.u32(map->count);
+              for (const auto& entry : map->entries) {
+                  if (entry.distance >= 0) {
+                      writeValue(out, entry.key);
+                      writeValue(out, entry.value);
+                  }
+              }
+              break;
+          }
+          case ObjectType::FLOAT64_ARRAY: {
+              auto& data = AS_FLOAT64_ARRAY(value)->data;
+              out.u32(data.size());
+              out.bytes(data.data(), data.size() * sizeof(double));
+              break;
+          }
+          case ObjectType::ARRAY: {
+              auto& elements = AS_ARRAY(value)->elements;
+              out.u32(elements.size());
+              for (const auto& element : elements) {
+                  writeValue(out, element);
+              }
+              break;
+          }
+          case ObjectType::FIBER:
+          case ObjectType::CHANNEL:
+              DIE << "[HeapSnapshot]: unreachable: " << evaValueToTypeString(value)
+                  << " object in the snapshot";
+      }
+  }
+
+  /**
+   * Reads object payload into the shell.
+   */
+  void readObject(BinaryReader& in, Object* object) {
+      auto value = OBJECT(object);
+      switch (object->type) {
+          case ObjectType::STRING:
+              AS_STRING(value)->string = in.string();
+              break;
+          case ObjectType::NATIVE:
+              break;
+          case ObjectType::CODE: {
+              auto co = AS_CODE(value);
+              co->name = in.string();
+              co->arity = in.u32();
+              co->freeCount = in.u32();
+              co->isAsync = in.u8() != 0;
+              co->cellNames.resize(in.count());
+              for (auto& cellName : co->cellNames) {
+                  cellName = in.string();
+              }
+              co->locals.resize(in.count());
+              for (auto& local : co->locals) {
+                  local.name = in.string();
+                  local.scopeLevel = in.u32();
+              }
+              co->constants.resize(in.count());
+              for (auto& constant : co->constants) {
+                  constant = readValue(in);
+              }
+              co->mappedCodeSize = in.u32();
+              co->mappedCode = (uint8_t*)in.bytes(co->mappedCodeSize);
+              co->line = in.u32();
+              auto lineTableSize = in.count();
+              auto lineTable = in.bytes(lineTableSize);
+              if (lineTable != nullptr) {
+                  co->lineTable.assign(lineTable, lineTable + lineTableSize);
+              }
+              break;
+          }
+          case ObjectType::FUNCTION: {
+              auto fn = AS_FUNCTION(value);
+              fn->co = (CodeObject*)readRef(in, ObjectType::CODE);
+              fn->cells.resize(in.count());
+              for (auto& cell : fn->cells) {
+                  cell = (CellObject*)readRef(in, ObjectType::CELL);
+              }
+              break;
+          }
+          case ObjectType::CELL:
+              AS_CELL(value)->value = readValue(in);
+              break;
+          case ObjectType::CLASS: {
+              auto cls = AS_CLASS(value);
+              cls->name = in.string();
+              cls->superClass =
+                  (ClassObject*)readRef(in, ObjectType::CLASS, /* nullable */ true);
+              readProperties(in, cls->properties);
+              break;
+          }
+          case ObjectType::INSTANCE: {
+              auto instance = AS_INSTANCE(value);
+              instance->cls = (ClassObject*)readRef(in, ObjectType::CLASS);
+              readProperties(in, instance->properties);
+              break;
+          }
+          case ObjectType::MAP: {
+              auto map = AS_MAP(value);
+              auto count = in.count();
+              for (uint32_t i = 0; i < count && in.ok; i++) {
+                  auto key = readValue(in);
+                  auto entryValue = readValue(in);
+                  if (!MapObject::isValidKey(key)) {
+                      in.ok = false;
+                      break;
+                  }
+                  // Inserted after all the payloads are read
+                  mapEntries_.push_back({map, key, entryValue});
+              }
+              break;
+          }
+          case ObjectType::FLOAT64_ARRAY: {
+              auto array = AS_FLOAT64_ARRAY(value);
+              auto count = in.count();
+              auto bytes = in.bytes(count * sizeof(double));
+              if (bytes != nullptr) {
+                  array->resize(count);
+                  std::memcpy(array->data.data(), bytes, count * sizeof(double));
+              }
+              break;
+          }
+          case ObjectType::ARRAY: {
+              auto array = AS_ARRAY(value);
+              auto count = in.count();
+              array->reserve(count);
+              for (uint32_t i = 0; i < count && in.ok; i++) {
+                  array->push(readValue(in));
+              }
+              break;
+          }
+          case ObjectType::FIBER:
+          case ObjectType::CHANNEL:
+              DIE << "[HeapSnapshot]: unreachable: " << evaValueToTypeString(value)
+                  << " shell in the snapshot";
+      }
+  }
+
+  void writeProperties(BinaryWriter& out,
+                       const std::map<std::string, EvaValue>& properties) {
+      out.u32(properties.size());
+      for (const auto& [name, value] : properties) {
+          out.string(name);
+          writeValue(out, value);
+      }
+  }
+
+  void readProperties(BinaryReader& in,
+                      std::map<std::string, EvaValue>& properties) {
+      auto count = in.count();
+      for (uint32_t i = 0; i < count && in.ok; i++) {
+          auto name = in.string();
+          properties[name] = readValue(in);
+      }
+  }
+
+  /**
+   * Writes an object reference (index in the object table).
+   */
+  void writeRef(BinaryWriter& out, const void* object) {
+      out.u32(object == nullptr ? EVAS_NULL : objectIndex_.at((Object*)object));
+  }
+
+  /**
+   * Reads (relocates) an object reference, checking the type.
+   * Null is accepted only for the optional references.
+   */
+  Object* readRef(BinaryReader& in, ObjectType type, bool nullable = false) {
+      auto index = in.u32();
+      if (index == EVAS_NULL) {
+          if (!nullable) {
+              in.ok = false;
+          }
+          return nullptr;
+      }
+      if (index >= objects_.size() || objects_[index]->type != type) {
+          in.ok = false;
+          return nullptr;
+      }
+      return objects_[index];
+  }
+
+  void writeValue(BinaryWriter& out, const EvaValue& value) {
+      if (IS_NUMBER(value)) {
+          out.u8((uint8_t)EvasValueTag::NUMBER);
+          out.f64(AS_NUMBER(value));
+      } else if (IS_BOOLEAN(value)) {
+          out.u8((uint8_t)EvasValueTag::BOOLEAN);
+          out.u8(AS_BOOLEAN(value));
+      } else {
+          out.u8((uint8_t)EvasValueTag::OBJECT);
+          writeRef(out, AS_OBJECT(value));
+      }
+  }
+
+  EvaValue readValue(BinaryReader& in) {
+      auto tag = (EvasValueTag)in.u8();
+      switch (tag) {
+          case EvasValueTag::NUMBER:
+              return NUMBER(in.f64());
+          case EvasValueTag::BOOLEAN:
+              return BOOLEAN(in.u8() != 0);
+          case EvasValueTag::OBJECT: {
+              auto index = in.u32();
+              if (index < objects_.size()) {
+                  return OBJECT(objects_[index]);
+              }
+              break;
+          }
+      }
+      in.ok = false;
+      return NUMBER(0);
+  }
+
+  /**
+   * Global object.
+   */
+  std::shared_ptr<Global> global;
+
+  /**
+   * Object table: index of each object, and objects by index.
+   */
+  std::map<Object*, uint32_t> objectIndex_;
+  std::vector<Object*> objects_;
+
+  /**
+   * Restored map entries (keys may be strings not read yet).
+   */
+  struct MapEntry {
+      MapObject* map;
+      EvaValue key;
+      EvaValue value;
+  };
+  std::vector<MapEntry> mapEntries_;
+
+  /**
+   * Mapped snapshot files.
+   */
+  MappedFiles files_;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Typed native bindings: natives generated from C++ functions.
+ */
+
+#ifndef NativeBinding_h
+#define NativeBinding_h
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "../Logger.h"
+#include "EvaValue.h"
+
+/**
+ * Conversion of a bound C++ type from and to Eva values: arithmetic
+ * types are numbers (integer types accept only the integral numbers
+ * of their range), bool is a boolean, std::string is a string
+ * (passed by reference, not copied), and EvaValue is passed as is.
+ *
+ * The conversion is selected at compile time, an argument costs one
+ * type check and the unboxing.
+ */
+template <typename T>
+struct NativeValue {
+  static_assert(std::is_same_v<T, EvaValue> || std::is_same_v<T, bool> ||
+                    std::is_arithmetic_v<T> || std::is_same_v<T, std::string>,
+                "Unsupported native binding type");
+
+  using Arg = std::conditional_t<std::is_same_v<T, std::string>, const std::string&, T>;
+
+  /**
+   * Unboxes the argument at the index.
+   */
+  static Arg from(EvaValue* args, size_t index) {
+      auto& value = args[index];
+      if constexpr (std::is_same_v<T, EvaValue>) {
+          return value;
+      } else if constexpr (std::is_same_v<T, bool>) {
+          if (!IS_BOOLEAN(value)) {
+              typeError(args, index, "a boolean");
+          }
+          return AS_BOOLEAN(value);
+      } else if constexpr (std::is_integral_v<T>) {
+          if (!IS_NUMBER(value)) {
+              typeError(args, index, "a number");
+          }
+          // The cast is undefined for NaN, fractions out of range, etc.
+          // Range of T: [min, 2^digits), exact in double
+          constexpr auto lower = (double)std::numeric_limits<T>::min();
+          constexpr auto upper =
+              2.0 * (double)((std::numeric_limits<T>::max() >> 1) + 1);
+          auto number = AS_NUMBER(value);
+          if (!(number >= lower && number < upper && std::trunc(number) == number)) {
+              rangeError(args, index);
+          }
+          return (T)number;
+      } else if constexpr (std::is_arithmetic_v<T>) {
+          if (!IS_NUMBER(value)) {
+              typeError(args, index, "a number");
+          }
+          return (T)AS_NUMBER(value);
+      } else {
+          if (!IS_STRING(value)) {
+              typeError(args, index, "a string");
+          }
+          return AS_CPPSTRING(value);
+      }
+  }
+
+  /**
+   * Boxes the result (strings are allocated, and can trigger GC).
+   */
+  template <typename VM>
+  static EvaValue to(VM* vm, const T& value) {
+      if constexpr (std::is_same_v<T, EvaValue>) {
+          return value;
+      } else if constexpr (std::is_same_v<T, bool>) {
+          return BOOLEAN(value);
+      } else if constexpr (std::is_arithmetic_v<T>) {
+          return NUMBER((double)value);
+      } else {
+          vm->maybeGC();
+          return ALLOC_STRING(value);
+      }
+  }
+
+ private:
+  static void typeError(EvaValue* args, size_t index, const char* expected) {
+      DIE << "[EvaVM]: " << AS_NATIVE(args[-1])->name << ": argument "
+          << index + 1 << " expects " << expected << ", got "
+          << evaValueToTypeString(args[index]);
+  }
+
+  static void rangeError(EvaValue* args, size_t index) {
+      DIE << "[EvaVM]: " << AS_NATIVE(args[-1])->name << ": argument "
+          << index + 1 << " expects an integer in the range of the bound type, got "
+          << AS_NUMBER(args[index]);
+  }
+};
+
+/**
+ * Binding of a C++ function type: the arity, and the call with the
+ * unboxed arguments (a void result is returned as true).
+ */
+template <typename Fn>
+struct NativeBinding;
+
+template <typename R, typename... Args>
+struct NativeBinding<R (*)(Args...)> {
+  static constexpr size_t arity = sizeof...(Args);
+
+  template <typename VM, typename F>
+  static EvaValue call(VM* vm, F fn, EvaValue* args) {
+      return call(vm, fn, args, std::index_sequence_for<Args...>{});
+  }
+
+ private:
+  template <typename VM, typename F, size_t... I>
+  static EvaValue call(VM* vm, F fn, EvaValue* args, std::index_sequence<I...>) {
+      if constexpr (std::is_void_v<R>) {
+          fn(NativeValue<std::decay_t<Args>>::from(args, I)...);
+          return BOOLEAN(true);
+      } else {
+          return NativeValue<std::decay_t<R>>::to(
+              vm, fn(NativeValue<std::decay_t<Args>>::from(args, I)...));
+      }
+  }
+};
+
+/**
+ * Native of a function known at compile time: a direct
+ * (inlinable) call of the function.
+ */
+template <auto Fn>
+struct StaticNative {
+  static EvaValue invoke(EvaVM* vm, EvaValue* args, size_t argc) {
+      return NativeBinding<decltype(Fn)>::call(vm, Fn, args);
+  }
+};
+
+/**
+ * Native of a function pointer given at runtime: the pointer is
+ * stored in the native object (args[-1]), and called indirectly.
+ */
+template <typename Fn>
+struct DynamicNative {
+  static EvaValue invoke(EvaVM* vm, EvaValue* args, size_t argc) {
+      auto fn = reinterpret_cast<Fn>(AS_NATIVE(args[-1])->target);
+      return NativeBinding<Fn>::call(vm, fn, args);
+  }
+};
+
+#endif
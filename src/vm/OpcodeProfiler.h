@@ -0,0 +1,233 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Opcode-level execution profiler.
+ */
+
+#ifndef OpcodeProfiler_h
+#define OpcodeProfiler_h
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../bytecode/OpCode.h"
+#include "../disassembler/EvaDisassembler.h"
+#include "EvaValue.h"
+
+/**
+ * Number of the hottest instructions highlighted in the report.
+ */
+#define PROFILE_HOT_COUNT 10
+
+/**
+ * Opcode profiler: counts executions and cycles per opcode, per code
+ * object and per bytecode offset.
+ *
+ * Enabled at build time with EVA_PROFILE (see EvaVM.h), otherwise
+ * the VM has no profiling code at all. An instruction's cycles are
+ * the time until the next instruction starts, so fiber switches and
+ * natives are charged to the instruction that ran them.
+ *
+ * Cycles are TSC ticks on x86, nanoseconds elsewhere.
+ */
+class OpcodeProfiler {
+ public:
+  /**
+   * Executions and cycles.
+   */
+  struct Counter {
+      uint64_t count = 0;
+      uint64_t cycles = 0;
+  };
+
+  /**
+   * Starts the instruction at the offset (and ends the previous one).
+   */
+  void enter(CodeObject* co, size_t offset, uint8_t opcode) {
+      auto now = ticks();
+      stop(now);
+      if (co != lastCo_) {
+          lastCo_ = co;
+          lastCounters_ = &offsets_[co];
+      }
+      if (lastCounters_->size() < co->getCodeSize()) {
+          lastCounters_->resize(co->getCodeSize());
+      }
+      current_ = lastCounters_;
+      currentOffset_ = offset;
+      currentOpcode_ = opcode;
+      start_ = now;
+  }
+
+  /**
+   * Ends the running instruction (e.g. when the program halts).
+   */
+  void stop() { stop(ticks()); }
+
+  /**
+   * Profiled code objects (kept alive for the report).
+   */
+  std::vector<CodeObject*> codeObjects() {
+      std::vector<CodeObject*> codeObjects;
+      for (auto& entry : offsets_) {
+          codeObjects.push_back(entry.first);
+      }
+      return codeObjects;
+  }
+
+  /**
+   * Prints the opcode and code object totals, and the annotated
+   * disassembly (with source lines) with the hottest instructions
+   * highlighted.
+   */
+  void report(EvaDisassembler& disassembler) {
+      stop();
+      uint64_t totalCycles = 0;
+      for (auto& counter : opcodes_) {
+          totalCycles += counter.cycles;
+      }
+      if (totalCycles == 0) {
+          return;
+      }
+      auto percent = [&](uint64_t cycles) {
+          return 100.0 * cycles / totalCycles;
+      };
+
+      std::cout << "\n---------- Profile: opcodes ----------\n\n";
+      std::vector<uint8_t> opcodes;
+      for (size_t opcode = 0; opcode < opcodes_.size(); opcode++) {
+          if (opcodes_[opcode].count > 0) {
+              opcodes.push_back(opcode);
+          }
+      }
+      std::sort(opcodes.begin(), opcodes.end(), [&](uint8_t a, uint8_t b) {
+          return opcodes_[a].cycles > opcodes_[b].cycles;
+      });
+      for (auto opcode : opcodes) {
+          auto& counter = opcodes_[opcode];
+          std::cout << std::left << std::setw(18) << opcodeToString(opcode)
+                    << std::right << std::setw(12) << counter.count
+                    << std::setw(16) << counter.cycles << std::fixed
+                    << std::setprecision(2) << std::setw(8)
+                    << percent(counter.cycles) << "%" << std::setw(10)
+                    << (double)counter.cycles / counter.count << " /op\n";
+      }
+
+      // Code objects by cycles, and the hottest instructions
+      std::vector<std::pair<CodeObject*, Counter>> codeObjects;
+      std::vector<uint64_t> instructionCycles;
+      for (auto& entry : offsets_) {
+          Counter total;
+          for (auto& counter : entry.second) {
+              total.count += counter.count;
+              total.cycles += counter.cycles;
+              if (counter.count > 0) {
+                  instructionCycles.push_back(counter.cycles);
+              }
+          }
+          if (total.count > 0) {
+              codeObjects.push_back({entry.first, total});
+          }
+      }
+      std::sort(codeObjects.begin(), codeObjects.end(),
+                [](auto& a, auto& b) { return a.second.cycles > b.second.cycles; });
+      std::sort(instructionCycles.rbegin(), instructionCycles.rend());
+      auto hotCycles = instructionCycles[std::min<size_t>(
+          PROFILE_HOT_COUNT, instructionCycles.size()) - 1];
+
+      std::cout << "\n---------- Profile: code objects ----------\n\n";
+      for (auto& entry : codeObjects) {
+          std::cout << std::left << std::setw(24) << entry.first->name
+                    << std::right << std::setw(12) << entry.second.count
+                    << std::setw(16) << entry.second.cycles << std::fixed
+                    << std::setprecision(2) << std::setw(8)
+                    << percent(entry.second.cycles) << "%\n";
+      }
+
+      for (auto& entry : codeObjects) {
+          auto& counters = offsets_[entry.first];
+          disassembler.disassemble(entry.first, [&](size_t offset) {
+              auto& counter = counters[offset];
+              auto isHot = counter.count > 0 && counter.cycles >= hotCycles;
+              std::cout << (isHot ? ">> " : "   ") << std::fixed
+                        << std::setprecision(2) << std::setw(6)
+                        << percent(counter.cycles) << "% " << std::setw(10)
+                        << counter.count << "  line " << std::left
+                        << std::setw(5) << entry.first->getLine(offset)
+                        << std::right;
+          });
+      }
+      std::cout << std::defaultfloat;
+  }
+
+ private:
+  /**
+   * Current time in cycles.
+   */
+  static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+#endif
+  }
+
+  void stop(uint64_t now) {
+      if (current_ == nullptr) {
+          return;
+      }
+      auto cycles = now - start_;
+      auto& counter = (*current_)[currentOffset_];
+      counter.count++;
+      counter.cycles += cycles;
+      opcodes_[currentOpcode_].count++;
+      opcodes_[currentOpcode_].cycles += cycles;
+      current_ = nullptr;
+  }
+
+  /**
+   * Totals per opcode.
+   */
+  std::array<Counter, 256> opcodes_{};
+
+  /**
+   * Counters per code object and bytecode offset.
+   */
+  std::unordered_map<CodeObject*, std::vector<Counter>> offsets_;
+
+  /**
+   * Running instruction.
+   */
+  std::vector<Counter>* current_ = nullptr;
+  size_t currentOffset_ = 0;
+  uint8_t currentOpcode_ = 0;
+  uint64_t start_ = 0;
+
+  /**
+   * Counters of the last code object (skips the lookup within a function).
+   */
+  CodeObject* lastCo_ = nullptr;
+  std::vector<Counter>* lastCounters_ = nullptr;
+};
+
+#endif
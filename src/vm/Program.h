@@ -0,0 +1,83 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Compiled program handle.
+ */
+
+#ifndef Program_h
+#define Program_h
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include "EvaValue.h"
+
+/**
+ * Main functions of the live programs (GC roots of the VM).
+ */
+using ProgramRoots = std::unordered_set<FunctionObject*>;
+
+/**
+ * Compiled program: returned by EvaVM::compile, and executed any
+ * number of times by EvaVM::run.
+ *
+ * The handle (and its copies) keeps the main function, and so all
+ * the code of the program alive. Once the last copy is destroyed
+ * the code is reclaimed by the next GC of the VM. A handle may
+ * outlive its VM (it's just invalid then), but is used and
+ * destroyed on the VM thread only.
+ */
+class Program {
+ public:
+  Program() = default;
+
+  /**
+   * Whether the handle refers to a compiled program.
+   */
+  bool valid() const { return state_ != nullptr; }
+
+  /**
+   * Number of parameters (arguments of run).
+   */
+  size_t paramsCount() const { return state_ == nullptr ? 0 : state_->params.size(); }
+
+ private:
+  friend class EvaVM;
+
+  struct State {
+      ~State() {
+          if (auto roots = this->roots.lock()) {
+              roots->erase(main);
+          }
+      }
+
+      // Program entry point
+      FunctionObject* main;
+      // Global indices of the parameters
+      std::vector<int> params;
+      // Roots of the VM which compiled the program
+      std::weak_ptr<ProgramRoots> roots;
+  };
+
+  Program(FunctionObject* main, std::vector<int> params,
+          const std::shared_ptr<ProgramRoots>& roots)
+      : state_(std::make_shared<State>()) {
+      state_->main = main;
+      state_->params = std::move(params);
+      state_->roots = roots;
+      roots->insert(main);
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+#endif
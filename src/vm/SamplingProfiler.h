@@ -0,0 +1,218 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Sampling profiler.
+ */
+
+#ifndef SamplingProfiler_h
+#define SamplingProfiler_h
+
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EvaValue.h"
+
+/**
+ * Default sampling frequency (Hz).
+ */
+#define PROFILE_SAMPLE_HZ 1000
+
+/**
+ * Sampling profiler: a CPU-time timer of the VM thread raises SIGPROF,
+ * the handler only sets the pending flag, and the eval loop takes the
+ * sample before the next instruction (the call stack is consistent
+ * there). Time spent in natives is charged to the calling function.
+ *
+ * Samples are aggregated as folded stacks of function names and
+ * lines ("main:12;foo:3;bar:7 42"), the input format of flamegraph.pl.
+ */
+class SamplingProfiler {
+ public:
+  ~SamplingProfiler() { stop(); }
+
+  /**
+   * Starts sampling the calling thread at the given frequency
+   * (CPU-time timers are bounded by the kernel tick rate).
+   */
+  bool start(int hz = PROFILE_SAMPLE_HZ) {
+      if (running_ || hz <= 0) {
+          return false;
+      }
+      if (!installHandler()) {
+          return false;
+      }
+
+      // Per-thread timer: each VM isolate samples its own thread
+      sigevent event{};
+      event.sigev_notify = SIGEV_THREAD_ID;
+      event.sigev_signo = SIGPROF;
+      event.sigev_value.sival_ptr = this;
+      event._sigev_un._tid = syscall(SYS_gettid);
+      if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_) != 0) {
+          releaseHandler();
+          return false;
+      }
+      auto period = 1000000000L / hz;
+      itimerspec interval{};
+      interval.it_interval.tv_sec = period / 1000000000L;
+      interval.it_interval.tv_nsec = period % 1000000000L;
+      interval.it_value = interval.it_interval;
+      if (timer_settime(timer_, 0, &interval, nullptr) != 0) {
+          timer_delete(timer_);
+          releaseHandler();
+          return false;
+      }
+      running_ = true;
+      return true;
+  }
+
+  /**
+   * Stops sampling (the collected stacks are kept). The previous
+   * SIGPROF handler is restored once no profiler is running.
+   */
+  void stop() {
+      if (!running_) {
+          return;
+      }
+      // A signal of the timer may be queued already: it's discarded
+      // while blocked, before the previous handler is back
+      sigset_t mask, prevMask;
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGPROF);
+      pthread_sigmask(SIG_BLOCK, &mask, &prevMask);
+      timer_delete(timer_);
+      timespec noWait{};
+      while (sigtimedwait(&mask, nullptr, &noWait) == SIGPROF) {
+      }
+      releaseHandler();
+      pthread_sigmask(SIG_SETMASK, &prevMask, nullptr);
+      running_ = false;
+      pending = 0;
+  }
+
+  /**
+   * Records a sample: the frames of the call stack (callers
+   * first), and the running function.
+   */
+  void sample(FunctionObject* fn, uint8_t* ip, const std::vector<Frame>& callStack) {
+      pending = 0;
+      key_.clear();
+      for (auto& frame : callStack) {
+          if (frame.fn != nullptr) {
+              // The call instruction ends before the return address
+              appendFrame(frame.fn, frame.ra - 1);
+              key_ += ';';
+          }
+      }
+      appendFrame(fn, ip);
+      stacks_[key_]++;
+      samples++;
+  }
+
+  /**
+   * Writes the folded stacks.
+   */
+  bool save(const std::string& fileName) {
+      std::ofstream out(fileName);
+      for (auto& entry : stacks_) {
+          out << entry.first << " " << entry.second << "\n";
+      }
+      return (bool)out;
+  }
+
+  /**
+   * Set by the signal handler, checked by the eval loop.
+   */
+  volatile sig_atomic_t pending = 0;
+
+  /**
+   * Number of samples taken.
+   */
+  size_t samples = 0;
+
+ private:
+  /**
+   * The handler is shared by the profilers of all the isolates:
+   * installed by the first one started, and the previous one is
+   * restored when the last one stops.
+   */
+  static bool installHandler() {
+      std::lock_guard<std::mutex> lock(handlerMutex_);
+      if (handlerUsers_ == 0) {
+          struct sigaction action {};
+          action.sa_sigaction = &SamplingProfiler::onSignal;
+          action.sa_flags = SA_SIGINFO | SA_RESTART;
+          sigemptyset(&action.sa_mask);
+          if (sigaction(SIGPROF, &action, &prevAction_) != 0) {
+              return false;
+          }
+      }
+      handlerUsers_++;
+      return true;
+  }
+
+  static void releaseHandler() {
+      std::lock_guard<std::mutex> lock(handlerMutex_);
+      if (--handlerUsers_ == 0) {
+          sigaction(SIGPROF, &prevAction_, nullptr);
+      }
+  }
+
+  /**
+   * Only the signals of our timer carry the profiler pointer
+   * (others, e.g. from setitimer, are ignored).
+   */
+  static void onSignal(int, siginfo_t* info, void*) {
+      if (info->si_code != SI_TIMER) {
+          return;
+      }
+      ((SamplingProfiler*)info->si_value.sival_ptr)->pending = 1;
+  }
+
+  /**
+   * Frame name: the function, and the line of the instruction at ip.
+   */
+  void appendFrame(FunctionObject* fn, uint8_t* ip) {
+      key_ += fn->co->name;
+      key_ += ':';
+      key_ += std::to_string(fn->co->getLine(ip - fn->co->getCode()));
+  }
+
+  /**
+   * Sample counts per folded stack.
+   */
+  std::unordered_map<std::string, size_t> stacks_;
+
+  /**
+   * Folded stack being built (reused between samples).
+   */
+  std::string key_;
+
+  timer_t timer_;
+  bool running_ = false;
+
+  /**
+   * Running profilers, and the handler before the first one.
+   */
+  static inline std::mutex handlerMutex_;
+  static inline int handlerUsers_ = 0;
+  static inline struct sigaction prevAction_ {};
+};
+
+#endif
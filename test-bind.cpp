@@ -0,0 +1,56 @@
+/**
+ * Eva programming language.
+ *
+ * VM implementation.
+ *
+ * Course info: http://dmitrysoshnikov.com/courses/virtual-machine/
+ *
+ * (C) 2021-present Dmitry Soshnikov <dmitry.soshnikov@gmail.com>
+ */
+
+/**
+ * Bound natives check: evaluates the expression with a few hundred
+ * bound natives (more than a 1-byte global index can address).
+ *
+ *   test-bind '(last 1)'        // 101
+ *   test-bind '(byte 300)'      // range error
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "src/Logger.h"
+#include "src/vm/EvaVM.h"
+#include "src/vm/EvaValue.h"
+
+/**
+ * Number of filler natives bound before the checked ones.
+ */
+#define FILLER_NATIVES 299
+
+int main(int argc, char const* argv[]) {
+  if (argc != 2) {
+    std::cout << "\nUsage: test-bind <expression>\n\n";
+    return 0;
+  }
+
+  EvaVM vm;
+
+  for (auto i = 0; i < FILLER_NATIVES; i++) {
+    vm.bind("filler-" + std::to_string(i), +[](double x) { return x + 1; });
+  }
+
+  vm.bind("last", +[](double x) { return x + 100; });
+  vm.bind("byte", +[](uint8_t x) { return (double)x; });
+  vm.bind("shout", +[](const std::string& s) { return s + "!"; });
+  vm.bind("negate", +[](bool b) { return !b; });
+
+  auto result = vm.exec(argv[1]);
+
+  std::cout << "\n";
+  LOG(result);
+  std::cout << "\n";
+
+  return 0;
+}